@@ -116,6 +116,52 @@ void block_write(struct block *block, block_sector_t sector,
     block->write_cnt++;
 }
 
+/*! Reads CNT consecutive sectors, starting at SECTOR, from BLOCK. Sector 
+    SECTOR + I goes into BUFFERS[I], which must have room for 
+    BLOCK_SECTOR_SIZE bytes. Drivers that can will move the whole run with
+    one request. Internally synchronizes accesses to block devices, so
+    external per-block device locking is unneeded. */
+void block_read_multiple(struct block *block, block_sector_t sector,
+                         size_t cnt, void **buffers) {
+    size_t i;
+
+    if (cnt == 0)
+        return;
+    check_sector(block, sector);
+    check_sector(block, sector + cnt - 1);
+    ASSERT(block->type != BLOCK_FOREIGN);
+    if (block->ops->read_multiple != NULL) {
+        block->ops->read_multiple(block->aux, sector, cnt, buffers);
+    } else {
+        for (i = 0; i < cnt; i++)
+            block->ops->read(block->aux, sector + i, buffers[i]);
+    }
+    block->read_cnt += cnt;
+}
+
+/*! Writes CNT consecutive sectors, starting at SECTOR, to BLOCK. Sector 
+    SECTOR + I comes from BUFFERS[I], which must contain BLOCK_SECTOR_SIZE
+    bytes. Returns after the block device has acknowledged receiving all the
+    data. Internally synchronizes accesses to block devices, so external
+    per-block device locking is unneeded. */
+void block_write_multiple(struct block *block, block_sector_t sector,
+                          size_t cnt, void **buffers) {
+    size_t i;
+
+    if (cnt == 0)
+        return;
+    check_sector(block, sector);
+    check_sector(block, sector + cnt - 1);
+    ASSERT(block->type != BLOCK_FOREIGN);
+    if (block->ops->write_multiple != NULL) {
+        block->ops->write_multiple(block->aux, sector, cnt, buffers);
+    } else {
+        for (i = 0; i < cnt; i++)
+            block->ops->write(block->aux, sector + i, buffers[i]);
+    }
+    block->write_cnt += cnt;
+}
+
 /*! Returns the number of sectors in BLOCK. */
 block_sector_t block_size(struct block *block) {
     return block->size;
@@ -52,6 +52,10 @@ struct block *block_next(struct block *);
 block_sector_t block_size(struct block *);
 void block_read(struct block *, block_sector_t, void *);
 void block_write(struct block *, block_sector_t, const void *);
+void block_read_multiple(struct block *, block_sector_t, size_t cnt,
+                         void **buffers);
+void block_write_multiple(struct block *, block_sector_t, size_t cnt,
+                          void **buffers);
 const char *block_name(struct block *);
 enum block_type block_type(struct block *);
 
@@ -60,9 +64,15 @@ void block_print_stats(void);
 
 /* Lower-level interface to block device drivers. */
 
+/*! The multiple-sector operations may be null, in which case the block
+    layer falls back on one single-sector operation per sector. */
 struct block_operations {
     void (*read)(void *aux, block_sector_t, void *buffer);
     void (*write)(void *aux, block_sector_t, const void *buffer);
+    void (*read_multiple)(void *aux, block_sector_t, size_t cnt, 
+                          void **buffers);
+    void (*write_multiple)(void *aux, block_sector_t, size_t cnt, 
+                           void **buffers);
 };
 
 struct block *block_register(const char *name, enum block_type,
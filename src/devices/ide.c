@@ -57,6 +57,9 @@
 #define CMD_WRITE_SECTOR_RETRY 0x30     /*!< WRITE SECTOR with retries. */
 /*! @} */
 
+/*! Most sectors one READ/WRITE SECTOR command can move. */
+#define IDE_MAX_SECTORS_PER_COMMAND 256
+
 /*! An ATA device. */
 struct ata_disk {
     char name[8];               /*!< Name, e.g. "hda". */
@@ -90,7 +93,7 @@ static void reset_channel(struct channel *);
 static bool check_device_type(struct ata_disk *);
 static void identify_ata_device(struct ata_disk *);
 
-static void select_sector(struct ata_disk *, block_sector_t);
+static void select_sector(struct ata_disk *, block_sector_t, size_t cnt);
 static void issue_pio_command(struct channel *, uint8_t command);
 static void input_sector(struct channel *, void *);
 static void output_sector(struct channel *, const void *);
@@ -315,53 +318,110 @@ static char * descramble_ata_string(char *string, int size) {
     return string;
 }
 
-/*! Reads sector SEC_NO from disk D into BUFFER, which must have room for
-    BLOCK_SECTOR_SIZE bytes.  Internally synchronizes accesses to disks,
-    so external per-disk locking is unneeded. */
-static void ide_read(void *d_, block_sector_t sec_no, void *buffer) {
+/*! Reads the CNT sectors starting at SEC_NO from disk D into BUFFERS, one
+    sector per buffer, each of which must have room for BLOCK_SECTOR_SIZE 
+    bytes. Runs longer than IDE_MAX_SECTORS_PER_COMMAND are split up. 
+    Internally synchronizes accesses to disks, so external per-disk locking
+    is unneeded. */
+static void ide_read_multiple(void *d_, block_sector_t sec_no, size_t cnt,
+                              void **buffers) {
     struct ata_disk *d = d_;
     struct channel *c = d->channel;
+    size_t i, n;
+
     lock_acquire(&c->lock);
-    select_sector(d, sec_no);
-    issue_pio_command(c, CMD_READ_SECTOR_RETRY);
-    sema_down(&c->completion_wait);
-    if (!wait_while_busy(d))
-        PANIC("%s: disk read failed, sector=%"PRDSNu, d->name, sec_no);
-    input_sector(c, buffer);
+    while (cnt > 0) {
+        n = cnt < IDE_MAX_SECTORS_PER_COMMAND ? 
+            cnt : IDE_MAX_SECTORS_PER_COMMAND;
+        select_sector(d, sec_no, n);
+        issue_pio_command(c, CMD_READ_SECTOR_RETRY);
+
+        /* The disk interrupts once for each sector it has ready. */
+        for (i = 0; i < n; i++) {
+            sema_down(&c->completion_wait);
+            if (!wait_while_busy(d))
+                PANIC("%s: disk read failed, sector=%"PRDSNu, 
+                      d->name, sec_no + i);
+            input_sector(c, buffers[i]);
+        }
+
+        sec_no += n;
+        buffers += n;
+        cnt -= n;
+    }
     lock_release(&c->lock);
 }
 
+/*! Writes the CNT sectors starting at SEC_NO to disk D from BUFFERS, one
+    sector per buffer, each of which must contain BLOCK_SECTOR_SIZE bytes.
+    Returns after the disk has acknowledged receiving all the data. Runs 
+    longer than IDE_MAX_SECTORS_PER_COMMAND are split up. Internally 
+    synchronizes accesses to disks, so external per-disk locking is 
+    unneeded. */
+static void ide_write_multiple(void *d_, block_sector_t sec_no, size_t cnt,
+                               void **buffers) {
+    struct ata_disk *d = d_;
+    struct channel *c = d->channel;
+    size_t i, n;
+
+    lock_acquire(&c->lock);
+    while (cnt > 0) {
+        n = cnt < IDE_MAX_SECTORS_PER_COMMAND ? 
+            cnt : IDE_MAX_SECTORS_PER_COMMAND;
+        select_sector(d, sec_no, n);
+        issue_pio_command(c, CMD_WRITE_SECTOR_RETRY);
+
+        /* The disk asks for each sector with DRQ, and interrupts once it
+           has taken it. */
+        for (i = 0; i < n; i++) {
+            if (!wait_while_busy(d))
+                PANIC("%s: disk write failed, sector=%"PRDSNu, 
+                      d->name, sec_no + i);
+            output_sector(c, buffers[i]);
+            sema_down(&c->completion_wait);
+        }
+
+        sec_no += n;
+        buffers += n;
+        cnt -= n;
+    }
+    lock_release(&c->lock);
+}
+
+/*! Reads sector SEC_NO from disk D into BUFFER, which must have room for
+    BLOCK_SECTOR_SIZE bytes.  Internally synchronizes accesses to disks,
+    so external per-disk locking is unneeded. */
+static void ide_read(void *d_, block_sector_t sec_no, void *buffer) {
+    ide_read_multiple(d_, sec_no, 1, &buffer);
+}
+
 /*! Write sector SEC_NO to disk D from BUFFER, which must contain
     BLOCK_SECTOR_SIZE bytes.  Returns after the disk has acknowledged
     receiving the data.  Internally synchronizes accesses to disks, so external
     per-disk locking is unneeded. */
 static void ide_write(void *d_, block_sector_t sec_no, const void *buffer) {
-    struct ata_disk *d = d_;
-    struct channel *c = d->channel;
-    lock_acquire(&c->lock);
-    select_sector(d, sec_no);
-    issue_pio_command(c, CMD_WRITE_SECTOR_RETRY);
-    if (!wait_while_busy(d))
-        PANIC("%s: disk write failed, sector=%"PRDSNu, d->name, sec_no);
-    output_sector(c, buffer);
-    sema_down(&c->completion_wait);
-    lock_release(&c->lock);
+    void *buffers[1] = { (void *) buffer };
+    ide_write_multiple(d_, sec_no, 1, buffers);
 }
 
 static struct block_operations ide_operations = {
     ide_read,
-    ide_write
+    ide_write,
+    ide_read_multiple,
+    ide_write_multiple
 };
-
+
 /*! Selects device D, waiting for it to become ready, and then writes SEC_NO
-    to the disk's sector selection registers.  (We use LBA mode.) */
-static void select_sector(struct ata_disk *d, block_sector_t sec_no) {
+    and CNT to the disk's sector selection registers.  (We use LBA mode.) */
+static void select_sector(struct ata_disk *d, block_sector_t sec_no,
+                          size_t cnt) {
     struct channel *c = d->channel;
 
     ASSERT(sec_no < (1UL << 28));
+    ASSERT(cnt > 0 && cnt <= IDE_MAX_SECTORS_PER_COMMAND);
   
     select_device_wait(d);
-    outb(reg_nsect(c), 1);
+    outb(reg_nsect(c), cnt);  /* 256 is written as 0, which means 256. */
     outb(reg_lbal(c), sec_no);
     outb(reg_lbam(c), sec_no >> 8);
     outb(reg_lbah(c), (sec_no >> 16));
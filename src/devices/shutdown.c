@@ -12,6 +12,7 @@
 #ifdef FILESYS
 #include "devices/block.h"
 #include "filesys/filesys.h"
+#include "filesys/cache.h"
 #endif
 
 /*! Keyboard control register port. */
@@ -108,6 +109,8 @@ static void print_stats(void) {
     thread_print_stats();
 #ifdef FILESYS
     block_print_stats();
+    cache_print_stats();
+    filesys_print_stats();
 #endif
     console_print_stats();
     kbd_print_stats();
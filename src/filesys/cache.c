@@ -9,43 +9,125 @@
 
 #include <debug.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <round.h>
 
 #include "devices/block.h"
+#include "devices/timer.h"
 #include "lib/kernel/list.h"
+#include "lib/kernel/bitmap.h"
+#include "threads/interrupt.h"
 #include "threads/synch.h"
 #include "threads/palloc.h"
 #include "threads/malloc.h"
+#include "threads/vaddr.h"
 #include "filesys/cache.h"
 #include "filesys/filesys.h"
+#include "lib/user/syscall.h"
 
 /* =============== Stubs ================== */ 
 
 void pull_sector_from_disk_to_cache(block_sector_t t, cache_sector_id c);
-void push_sector_from_cache_to_disk(block_sector_t t, cache_sector_id c);
-bool try_allocating_free_cache_sector(cache_sector_id* c, block_sector_t t);
-void select_cache_sector_for_eviction(cache_sector_id* c, block_sector_t t);
+cache_sector_id try_allocating_free_cache_sector(void);
+cache_sector_id select_cache_sector_for_eviction(void);
+static cache_sector_id try_selecting_cache_sector_for_eviction(void);
+static bool reserve_cache_sector(block_sector_t t, 
+    enum cache_sector_class cls, bool nowait, cache_sector_id *c, 
+    bool *free_sector_allocated);
+static void cache_policy_admit(cache_sector_id c, block_sector_t t, 
+    block_sector_t old, enum cache_sector_class cls);
+static bool claim_cache_sector_for_load(block_sector_t t, 
+    enum cache_sector_class cls, bool nowait, cache_sector_id *c);
+static void finish_load(block_sector_t t, cache_sector_id c, bool dirty,
+    bool prefetch);
 void evict_cached_sector (cache_sector_id c);
 void mark_cache_sector_as_accessed(cache_sector_id c);
 void mark_cache_sector_as_dirty(cache_sector_id c);
+static bool mark_cache_sector_as_clean(cache_sector_id c);
 bool is_disk_sector_in_cache (cache_sector_id c, block_sector_t t);
 void clear_sector(cache_sector_id c);
+static void cache_index_insert(block_sector_t t, cache_sector_id c, 
+    bool by_old);
+static void cache_index_remove(block_sector_t t, cache_sector_id c, 
+    bool by_old);
+static cache_sector_id cache_index_find(block_sector_t t, bool by_old);
+static void flush_dirty_sectors(bool all);
+static void wait_for_pending_io(struct cache_meta_data *m);
+static void acquire_io_lock(struct rwlock *l, bool read, bool io);
 
-/* =============== Statically Allocated Variables ================= */ 
+/* ================== Constants ============== */
+
+/*! Number of disk sectors that fit in one page of the cache. */
+#define DISK_SECTORS_PER_CACHE_PAGE (PGSIZE / BLOCK_SECTOR_SIZE)
 
-/*! List of the sectors N whose next elements N + 1 should be read ahead.
-    defined in filesys.c. */
-extern struct list ra_sectors;
+/* =============== Statically Allocated Variables ================= */ 
 
 /*! Cache circular queue head index for clock eviction */
 cache_sector_id cache_head;
 
-/*! Maintain a global allow_cache_sweeps lock permanently
-    This allows threads to search the cache meta^2 data for their 
-    sector of interest without having to worry about whether sector meta^2 data
-    changes partway through. They cannot spend a long time holding this lock.
-    See discussion of crabbing in Lecture 25! */
-struct lock allow_cache_sweeps; 
+/*! The cache meta^2 data is split into CACHE_STRIPES partitions by the hash
+    of the disk sector, each with its own lock. Holding the stripe lock for
+    disk sector T lets threads probe the index for T, and read or change the
+    meta^2 data of the cache sector filed under T, without worrying that it
+    changes partway through. They cannot spend a long time holding these
+    locks. See discussion of crabbing in Lecture 25!
+
+    A cache sector switching disk sectors is refiled from one stripe to
+    another, so that takes both stripe locks, always lowest stripe first. */
+static struct lock cache_stripe_locks[CACHE_STRIPES];
+
+/*! Serializes eviction: protects the clock hand (cache_head) and the free
+    cache sectors, and is held while choosing and claiming a victim. It is
+    always acquired before any stripe lock, never after. */
+static struct lock cache_clock_lock;
+
+/*! One bit per cache sector, for the clock eviction policy, and for sectors
+    which must be written back before they are evicted. Set without any lock
+    by cache_read/cache_write (bitmap_mark is a single instruction), and
+    consumed with bitmap_test_and_reset by whoever sweeps them. */
+static struct bitmap *cache_accessed_bits;
+static struct bitmap *cache_dirty_bits;
+
+/*! One bit per cache sector, set while it holds a sector brought in by
+    read-ahead that no one has asked for yet. */
+static struct bitmap *cache_prefetched_bits;
+
+/*! Number of bits set in cache_dirty_bits. Only changed with interrupts 
+    off, together with the bit, and read without any lock. */
+static volatile uint32_t cache_dirty_count;
+
+/*! Dirty watermarks, in percent of the cache from -fs-dirty and in cache 
+    sectors once file_cache_init has run, and how many ticks a sector may
+    stay dirty before write-behind writes it out anyway. */
+static unsigned dirty_high_percent = DEFAULT_DIRTY_HIGH_PERCENT;
+static unsigned dirty_low_percent = DEFAULT_DIRTY_LOW_PERCENT;
+static uint32_t dirty_high, dirty_low;
+static long long dirty_expire = DEFAULT_DIRTY_EXPIRE_TICKS;
+
+/*! Writers finding the cache dirtier than the high watermark wait on 
+    dirty_drained, under throttle_lock, till it's back under, or till the 
+    write-behind thread finishes a pass (counted by write_behind_passes), 
+    whichever is first. writers_throttled is how many are waiting. */
+static struct lock throttle_lock;
+static struct condition dirty_drained;
+static unsigned write_behind_passes;
+static unsigned writers_throttled;
+
+/*! A dirty cache sector C, holding disk sector SECTOR. */
+struct flush_entry {
+    block_sector_t sector;
+    cache_sector_id c;
+};
+
+/*! Dirty sectors are written out in one sweep up the disk, like an elevator
+    that only goes up (C-SCAN). The ones to write are sorted by disk sector 
+    into flush_order, then written starting from flush_elevator, the disk
+    sector after the last one written, wrapping around to the lowest. All 
+    protected by flush_lock. */
+static struct lock flush_lock;
+static struct flush_entry *flush_order;
+static block_sector_t flush_elevator;
 
 /* Pointer to the head of a contiguous array of cache_meta_data structs */
 struct cache_meta_data *supplemental_filesystem_cache_table;
@@ -53,36 +135,247 @@ struct cache_meta_data *supplemental_filesystem_cache_table;
 /* Pointer to the pages associated with the file system cache itself */
 void *file_system_cache;
 
-// The following two are defined in filesys.c.
-extern struct lock monitor_ra;
-extern struct condition cond_ra;
+/*! Number of disk sectors (or, if cache_size_is_percent, the percentage of 
+    the free kernel pool) requested for the cache with -fs-cache. */
+static uint32_t cache_size_request = DEFAULT_DISK_SECTORS_CACHED;
+static bool cache_size_is_percent = false;
+
+/*! Number of disk sectors the cache holds. Always a whole number of pages. */
+uint32_t num_disk_sectors_cached;
+
+/*! Heads of the bucket chains hashing disk sectors to the cache sectors
+    holding them. index_by_current is keyed on current_disk_sector, and
+    index_by_old on the old_disk_sector of cache sectors mid-eviction.
+    Each bucket is protected by its stripe lock, and there are 
+    cache_index_mask+1 buckets, a power of two no smaller than the cache. */
+static cache_sector_id *index_by_current;
+static cache_sector_id *index_by_old;
+static uint32_t cache_index_mask;
+
+/*! Cache sectors are never freed once allocated, so the free ones are always
+    next_free_cache_sector..num_disk_sectors_cached-1. Protected by 
+    cache_clock_lock. */
+static cache_sector_id next_free_cache_sector;
+
+/*! Cache sectors with a pin_count, and the most there may be, which keeps
+    pins from starving everything else of room. Protected by 
+    cache_clock_lock. */
+static uint32_t pinned_sectors, max_pinned_sectors;
+
+/*! Most sectors cache_prefetch claims in one run, a fraction of the cache
+    so a run never needs every sector that isn't pinned. */
+static size_t max_prefetch_run;
+
+/*! How many of CACHE_MAX_EVICT_RUN are left for evictions to claim dirty
+    neighbours with. Only changed with interrupts off. */
+static size_t evict_run_budget = CACHE_MAX_EVICT_RUN;
+
+/*! Replacement policy, chosen at boot with -fs-cache-policy. */
+static enum cache_policy cache_policy = CACHE_POLICY_2Q;
+
+/*! 2Q (Johnson & Shasha) keeps sectors seen for the first time on a FIFO
+    probation queue (A1in) of about a quarter of the cache, and everything
+    else in the main clock (Am). A sequential scan then only churns the
+    probation queue. Disk sectors evicted from probation are remembered in
+    a ghost ring (A1out) holding no data; if one is missed again soon, it
+    goes straight to the main clock. Index and inode sectors skip probation.
+
+    Ghost membership is kept as a count per hash bucket, so a false positive
+    just lets a sector skip probation. All of this is protected by 
+    cache_clock_lock. */
+static struct list probation_queue;
+static uint32_t probation_count;
+static uint32_t probation_target;
+static block_sector_t *ghost_ring;
+static uint32_t ghost_capacity, ghost_next, ghost_count;
+static uint32_t *ghost_counts;
+static uint32_t ghost_mask;
+
+/*! Hits, and misses that had to claim a cache sector. */
+static unsigned long long cache_hits, cache_misses;
+
+/*! Sectors brought in by read-ahead, and how many of those were then used,
+    or evicted before anyone asked for them. */
+static unsigned long long prefetch_issued, prefetch_used, prefetch_wasted;
+
+/*! Victims evicted as they were, and those written back first. Sectors 
+    written by flush_dirty_sectors, and writers it held up. */
+static unsigned long long clean_evictions, dirty_evictions;
+static unsigned long long write_behind_sectors, writers_held_up;
+
+/*! Sectors moved by cache_direct_io straight between disk and a caller's
+    buffer, and those it had to move through the cache instead. */
+static unsigned long long direct_sectors, direct_cached_sectors;
+
+/*! Pins refused for want of room under max_pinned_sectors. */
+static unsigned long long pins_refused;
+
+/*! Times threads found a sector mid-io and waited on its pending_io_lock,
+    or had to wait for its read_write_diskio_lock, and timer ticks spent 
+    waiting. Like the other counters, these aren't locked, so they're only
+    nearly right. */
+static unsigned long long pending_io_waits, pending_io_wait_ticks;
+static unsigned long long io_lock_waits, io_lock_wait_ticks;
 
 /* ========================= Functions ================== */
 
+/*! Parses the -fs-cache=SIZE kernel option. SIZE is either a count of disk
+    sectors to cache, or a percentage of the free kernel pool such as "10%".
+    Called while parsing the command line, before file_cache_init. */
+void file_cache_configure(const char *size) {
+    if (size == NULL || atoi(size) <= 0)
+        PANIC("-fs-cache needs a positive sector count or percentage");
+
+    cache_size_request = atoi(size);
+    cache_size_is_percent = strchr(size, '%') != NULL;
+    if (cache_size_is_percent && 
+        cache_size_request > MAX_CACHE_PERCENT_OF_KERNEL_POOL)
+        cache_size_request = MAX_CACHE_PERCENT_OF_KERNEL_POOL;
+}
+
+/*! Parses the -fs-cache-policy=POLICY kernel option, "clock" or "2q". */
+void file_cache_configure_policy(const char *policy) {
+    if (policy != NULL && !strcmp(policy, "clock"))
+        cache_policy = CACHE_POLICY_CLOCK;
+    else if (policy != NULL && !strcmp(policy, "2q"))
+        cache_policy = CACHE_POLICY_2Q;
+    else
+        PANIC("-fs-cache-policy must be \"clock\" or \"2q\"");
+}
+
+/*! Parses the -fs-dirty=HIGH,LOW kernel option, the dirty watermarks in 
+    percent of the cache. */
+void file_cache_configure_dirty(const char *watermarks) {
+    const char *comma = watermarks != NULL ? strchr(watermarks, ',') : NULL;
+    int high, low;
+
+    if (comma == NULL)
+        PANIC("-fs-dirty needs HIGH,LOW percentages");
+    high = atoi(watermarks);
+    low = atoi(comma + 1);
+    if (low < 0 || high <= low || high > 100)
+        PANIC("-fs-dirty needs 0 <= LOW < HIGH <= 100");
+
+    dirty_high_percent = high;
+    dirty_low_percent = low;
+}
+
+/*! Parses the -fs-dirty-expire=TICKS kernel option, how long a sector may 
+    stay dirty before write-behind writes it out. */
+void file_cache_configure_dirty_expire(const char *ticks) {
+    if (ticks == NULL || atoi(ticks) <= 0)
+        PANIC("-fs-dirty-expire needs a positive tick count");
+    dirty_expire = atoi(ticks);
+}
+
 /*! Initialize the disk cache and cache meta^2 data (different than inode
     meta data). Must be called after kernel pages have been allocated. 
 
-    Use palloc to allocate 64 contiguous sectors, or 8 pages for the cache.
+    Sizes the cache from the -fs-cache option (DEFAULT_DISK_SECTORS_CACHED
+    if there wasn't one), rounded up to whole pages and capped at 
+    MAX_CACHE_PERCENT_OF_KERNEL_POOL of the free kernel pool, but never
+    less than MIN_DISK_SECTORS_CACHED.
+    Use palloc to allocate the contiguous pages for the cache.
     Use calloc to allocate kernel memory for all the meta^2 data.
 
     This function will either succeed or panic the kernel. */
 void file_cache_init(void) {
+    size_t pool_pages = palloc_free_kernel_pages();
+    size_t max_pages = pool_pages * MAX_CACHE_PERCENT_OF_KERNEL_POOL / 100;
+    size_t cache_pages;
+
+    if (cache_size_is_percent)
+        cache_pages = pool_pages * cache_size_request / 100;
+    else
+        cache_pages = DIV_ROUND_UP(cache_size_request, 
+                                   DISK_SECTORS_PER_CACHE_PAGE);
+    if (cache_pages > max_pages)
+        cache_pages = max_pages;
+    if (cache_pages < MIN_DISK_SECTORS_CACHED / DISK_SECTORS_PER_CACHE_PAGE)
+        cache_pages = MIN_DISK_SECTORS_CACHED / DISK_SECTORS_PER_CACHE_PAGE;
+    num_disk_sectors_cached = cache_pages * DISK_SECTORS_PER_CACHE_PAGE;
+
     /*  We'll start off our eviction policy's circular queue at the first sector
         in our cache */
     cache_head = 0;                     
 
-    /*  Initialize the lock that ensures threads can sweep the cache suppl.
-        table and expect it to stay static while they sweep. */
-    lock_init(&allow_cache_sweeps);
-
-    /*  Allocate pages for our NUM_DISK_SECTORS_CACHED sector cache in the
+    /*  Initialize the locks that ensure threads can probe the cache suppl.
+        table and expect it to stay static while they look. */
+    int stripe;
+    for (stripe = 0; stripe < CACHE_STRIPES; stripe++)
+        lock_init(&cache_stripe_locks[stripe]);
+    lock_init(&cache_clock_lock);
+
+    /*  Nothing is cached yet, so every index chain is empty */
+    uint32_t buckets = 1;
+    while (buckets < num_disk_sectors_cached)
+        buckets <<= 1;
+    cache_index_mask = buckets - 1;
+    index_by_current = malloc(buckets * sizeof *index_by_current);
+    index_by_old = malloc(buckets * sizeof *index_by_old);
+    if (index_by_current == NULL || index_by_old == NULL)
+        PANIC("Couldn't allocate cache index.");
+
+    uint32_t b;
+    for (b = 0; b < buckets; b++) {
+        index_by_current[b] = NO_CACHE_SECTOR;
+        index_by_old[b] = NO_CACHE_SECTOR;
+    }
+    next_free_cache_sector = 0;
+    pinned_sectors = 0;
+    max_pinned_sectors = num_disk_sectors_cached * MAX_CACHE_PINNED_PERCENT /
+                         100;
+    max_prefetch_run = num_disk_sectors_cached / 4;
+    if (max_prefetch_run > CACHE_MAX_RUN)
+        max_prefetch_run = CACHE_MAX_RUN;
+    if (max_prefetch_run == 0)
+        max_prefetch_run = 1;
+
+    list_init(&probation_queue);
+    probation_count = 0;
+    probation_target = num_disk_sectors_cached / 4 > 0 ? 
+        num_disk_sectors_cached / 4 : 1;
+    ghost_capacity = num_disk_sectors_cached / 2 > 0 ? 
+        num_disk_sectors_cached / 2 : 1;
+    ghost_next = ghost_count = 0;
+    ghost_mask = 2 * buckets - 1;
+    ghost_ring = malloc(ghost_capacity * sizeof *ghost_ring);
+    ghost_counts = calloc(ghost_mask + 1, sizeof *ghost_counts);
+    if (ghost_ring == NULL || ghost_counts == NULL)
+        PANIC("Couldn't allocate cache replacement policy state.");
+
+    cache_accessed_bits = bitmap_create(num_disk_sectors_cached);
+    cache_dirty_bits = bitmap_create(num_disk_sectors_cached);
+    cache_prefetched_bits = bitmap_create(num_disk_sectors_cached);
+    if (cache_accessed_bits == NULL || cache_dirty_bits == NULL ||
+        cache_prefetched_bits == NULL)
+        PANIC("Couldn't allocate cache accessed/dirty bitmaps.");
+
+    lock_init(&flush_lock);
+    flush_order = malloc(num_disk_sectors_cached * sizeof *flush_order);
+    if (flush_order == NULL)
+        PANIC("Couldn't allocate cache flush order.");
+    flush_elevator = 0;
+
+    cache_dirty_count = 0;
+    dirty_high = num_disk_sectors_cached * dirty_high_percent / 100;
+    dirty_low = num_disk_sectors_cached * dirty_low_percent / 100;
+    if (dirty_high == 0)
+        dirty_high = 1;
+    if (dirty_low >= dirty_high)
+        dirty_low = dirty_high - 1;
+    lock_init(&throttle_lock);
+    cond_init(&dirty_drained);
+    write_behind_passes = writers_throttled = 0;
+
+    /*  Allocate pages for our num_disk_sectors_cached sector cache in the
         kernel pool */
     file_system_cache = palloc_get_multiple(PAL_ASSERT | PAL_ZERO, 
-                                                  NUM_DISK_CACHE_PAGES);        
+                                            cache_pages);        
 
     /* Allocate and initialize cache metadata in kernel space */
     supplemental_filesystem_cache_table = 
-        (struct cache_meta_data *) calloc(  NUM_DISK_SECTORS_CACHED, 
+        (struct cache_meta_data *) calloc(  num_disk_sectors_cached, 
                                             sizeof(struct cache_meta_data));
     if (supplemental_filesystem_cache_table == NULL) 
         PANIC("Couldn't allocate cache metadata table.");
@@ -90,52 +383,172 @@ void file_cache_init(void) {
     struct cache_meta_data *meta_walker = supplemental_filesystem_cache_table;
     void *fs_cache = file_system_cache;
 
-    int k;
-    for (k = 0; k < NUM_DISK_SECTORS_CACHED; k++) {        
+    uint32_t k;
+    for (k = 0; k < num_disk_sectors_cached; k++) {        
         meta_walker->cid = k;
         meta_walker->head_of_sector_in_memory = fs_cache;
         meta_walker->cache_sector_free = true;
-        meta_walker->cache_sector_dirty = false;
-        meta_walker->cache_sector_accessed = false;
         meta_walker->cache_sector_evicters_ignore = false;
+        meta_walker->sector_class = CACHE_CLASS_DATA;
+        meta_walker->on_probation = false;
         meta_walker->old_disk_sector = SILLY_OLD_DISK_SECTOR;
         meta_walker->current_disk_sector = SILLY_OLD_DISK_SECTOR;
+        meta_walker->dirtied_at = 0;
+        meta_walker->pin_count = 0;
         rw_init(&meta_walker->read_write_diskio_lock);
         lock_init(&meta_walker->pending_io_lock);
+        meta_walker->next_by_current = NO_CACHE_SECTOR;
+        meta_walker->next_by_old = NO_CACHE_SECTOR;
         fs_cache += BLOCK_SECTOR_SIZE;
         meta_walker += 1;
     }
 }
 
-/*! Increment head index, wrapping at NUM_DISK_SECTORS_CACHED to 0 
-    Must only be called with the lock allow_cache_sweeps locked so access
+/*! Increment head index, wrapping at num_disk_sectors_cached to 0 
+    Must only be called with the lock cache_clock_lock locked so access
     is synchronous. */
 static cache_sector_id update_head(void) {
-    cache_head = (cache_head + 1) & ((uint32_t) 0x0000003F); // This is % 64
+    if (++cache_head >= num_disk_sectors_cached)
+        cache_head = 0;
     return cache_head;
 }
 
+/*! Returns the index bucket disk sector T hashes to. Consecutive sectors
+    land in consecutive buckets, which is as good as it gets for us. */
+static inline uint32_t cache_index_bucket(block_sector_t t) {
+    return t & cache_index_mask;
+}
+
+/*! Returns the lock for the stripe of the cache index that disk sector T
+    hashes to. */
+static inline struct lock *cache_stripe_lock(block_sector_t t) {
+    return &cache_stripe_locks[cache_index_bucket(t) & (CACHE_STRIPES - 1)];
+}
+
+/*! Acquires the stripe locks for disk sectors A and B, lowest stripe first,
+    so that two threads refiling cache sectors can't deadlock. B may be 
+    SILLY_OLD_DISK_SECTOR, in which case only A's stripe is locked. */
+static void cache_lock_stripes(block_sector_t a, block_sector_t b) {
+    struct lock *la = cache_stripe_lock(a);
+    struct lock *lb = b == SILLY_OLD_DISK_SECTOR ? la : cache_stripe_lock(b);
+
+    if (lb < la) {
+        struct lock *tmp = la;
+        la = lb;
+        lb = tmp;
+    }
+    lock_acquire(la);
+    if (lb != la)
+        lock_acquire(lb);
+}
+
+/*! Releases the stripe locks taken by cache_lock_stripes(A, B). */
+static void cache_unlock_stripes(block_sector_t a, block_sector_t b) {
+    struct lock *la = cache_stripe_lock(a);
+    struct lock *lb = b == SILLY_OLD_DISK_SECTOR ? la : cache_stripe_lock(b);
+
+    if (lb != la)
+        lock_release(lb);
+    lock_release(la);
+}
+
+/*! Returns a pointer to the link field of cache sector C in the index chosen
+    by BY_OLD (see index_by_current and index_by_old). */
+static inline cache_sector_id *cache_index_link(cache_sector_id c, 
+    bool by_old) {
+    struct cache_meta_data *m = supplemental_filesystem_cache_table + c;
+    return by_old ? &m->next_by_old : &m->next_by_current;
+}
+
+/*! Files cache sector C under disk sector T in the index chosen by BY_OLD.
+    Must be called with T's stripe lock held. */
+static void cache_index_insert(block_sector_t t, cache_sector_id c, 
+    bool by_old) {
+    cache_sector_id *head = 
+        (by_old ? index_by_old : index_by_current) + cache_index_bucket(t);
+
+    *cache_index_link(c, by_old) = *head;
+    *head = c;
+}
+
+/*! Unfiles cache sector C from disk sector T's bucket in the index chosen by
+    BY_OLD. C must have been filed there. Must be called with T's stripe
+    lock held. */
+static void cache_index_remove(block_sector_t t, cache_sector_id c, 
+    bool by_old) {
+    cache_sector_id *walker = 
+        (by_old ? index_by_old : index_by_current) + cache_index_bucket(t);
+
+    while (*walker != c) {
+        ASSERT(*walker != NO_CACHE_SECTOR);
+        walker = cache_index_link(*walker, by_old);
+    }
+    *walker = *cache_index_link(c, by_old);
+    *cache_index_link(c, by_old) = NO_CACHE_SECTOR;
+}
+
+/*! Probes the index chosen by BY_OLD for disk sector T. Returns the cache 
+    sector filed under T, or NO_CACHE_SECTOR if there isn't one. Must be 
+    called with T's stripe lock held. */
+static cache_sector_id cache_index_find(block_sector_t t, bool by_old) {
+    cache_sector_id c = 
+        (by_old ? index_by_old : index_by_current)[cache_index_bucket(t)];
+    struct cache_meta_data *m;
+
+    while (c != NO_CACHE_SECTOR) {
+        m = supplemental_filesystem_cache_table + c;
+        if ((by_old ? m->old_disk_sector : m->current_disk_sector) == t)
+            break;
+        c = *cache_index_link(c, by_old);
+    }
+    return c;
+}
+
 /*! For external use, after an io lock has been granted and data has been 
-    written. Mark the cache sector c as dirty after acquiring a sweep lock. 
-    We do this after we've actually written something to the sector */
+    written. Mark the cache sector c as dirty. We do this after we've 
+    actually written something to the sector. 
+    
+    Sectors already dirty take no lock. Otherwise we turn interrupts off, 
+    so the bit, cache_dirty_count and dirtied_at change together. */
 void mark_cache_sector_as_dirty(cache_sector_id c) {
-    ASSERT(c < NUM_DISK_SECTORS_CACHED);
- 
-    lock_acquire(&allow_cache_sweeps);        
-    (supplemental_filesystem_cache_table+c)->cache_sector_dirty = true;
-    lock_release(&allow_cache_sweeps);
+    enum intr_level old_level;
+
+    ASSERT(c < num_disk_sectors_cached);
+    if (bitmap_test(cache_dirty_bits, c))
+        return;
+
+    old_level = intr_disable();
+    if (!bitmap_test(cache_dirty_bits, c)) {
+        bitmap_mark(cache_dirty_bits, c);
+        cache_dirty_count++;
+        supplemental_filesystem_cache_table[c].dirtied_at = timer_ticks();
+    }
+    intr_set_level(old_level);
+}
+
+/*! Clears the dirty bit of cache sector C, returning whether it was set. 
+    The io lock of C must be held, so nobody is dirtying it. */
+static bool mark_cache_sector_as_clean(cache_sector_id c) {
+    enum intr_level old_level;
+    bool was_dirty;
+
+    old_level = intr_disable();
+    was_dirty = bitmap_test_and_reset(cache_dirty_bits, c);
+    if (was_dirty)
+        cache_dirty_count--;
+    intr_set_level(old_level);
+
+    return was_dirty;
 }
 
 /*! For external use after an io or rw lock has been granted and the
     sector has been confirmed what was requested. 
 
-    Mark the cache sector c as accessed after acquiring a sweep lock. */
+    Mark the cache sector c as accessed. No lock is needed, the bit is set
+    atomically. */
 void mark_cache_sector_as_accessed(cache_sector_id c) {
-    ASSERT(c < NUM_DISK_SECTORS_CACHED);
-
-    lock_acquire(&allow_cache_sweeps);        
-    (supplemental_filesystem_cache_table+c)->cache_sector_accessed = true;
-    lock_release(&allow_cache_sweeps);
+    ASSERT(c < num_disk_sectors_cached);
+    bitmap_mark(cache_accessed_bits, c);
 }
 
 /* Clears a sector in cache that the caller has a rwlock on */
@@ -146,18 +559,6 @@ void clear_sector(cache_sector_id c) {
         BLOCK_SECTOR_SIZE);           
 }         
 
-/*! Gets sector N + 1 given sector N. */
-block_sector_t get_next_sector(block_sector_t curr_sector) {
-	// TODO CHANGE THIS OR DIE. That is, change after inode indirection is done
-    // Specifically, have whatever is traversing the cache for the first access
-    // call this with the next sector (if available). Alternatively, give
-    // an inode and an offset (next offset) to this function and let it find
-    // the next target. But don't pass a sector - then we have to traverse 
-    // the entire index one reference at a time, we can't take advantage of
-    // logarithmic search.
-	return curr_sector + 1;
-}
-
 /*! Accessor. Assumes appropriate rw_lock held. 
     Reads BYTES bytes from file cache sector SRC into DST, 
     starting at position (OFFSET > 0) in SRC. */
@@ -174,61 +575,6 @@ void cache_read(cache_sector_id src, void *dst, int offset, size_t bytes) {
             bytes);
 
     mark_cache_sector_as_accessed(src);
-
-    /* Add the next sector to the read-ahead queue. */
-    lock_acquire(&monitor_ra);
-    if (list_size(&ra_sectors) >= NUM_DISK_SECTORS_CACHED) {
-    	lock_release(&monitor_ra);
-    	return;
-    }
-    block_sector_t curr_sector = get_cache_metadata(src)->current_disk_sector;
-    block_sector_t next_sector = get_next_sector(curr_sector);
-
-    // Make sure next sector isn't already in the read-ahead queue.
-    struct list_elem *l;
-    struct ra_sect_elem *rasect;
-    bool found = false;
-    for (l = list_begin(&ra_sectors);
-			l != list_end(&ra_sectors);
-			l = list_next(l)) {
-		rasect = list_entry(l, struct ra_sect_elem, ra_elem);
-		if (rasect->sect_n == next_sector) {
-			found = true;
-			break;
-		}
-	}
-    if (found) {
-    	lock_release(&monitor_ra);
-    	return;
-    }
-
-    // Make sure the next sector isn't already in the cache.
-    struct cache_meta_data *meta_walker = supplemental_filesystem_cache_table;
-    //printf("--> about to acquire allow cache sweeps lock.\n");
-	lock_acquire(&allow_cache_sweeps);
-	int k;
-	for (k = 0; k < NUM_DISK_SECTORS_CACHED; k++) {
-		if (meta_walker[k].current_disk_sector == next_sector)
-			found = true;
-	}
-	//printf("--> about to relinquish allow cache sweeps lock.\n");
-	lock_release(&allow_cache_sweeps);
-    if (found) {
-    	lock_release(&monitor_ra);
-    	return;
-    }
-
-	// If the next sector isn't already in the read ahead queue and isn't
-	// already in the cache then put it in the read ahead cache.
-    rasect = (struct ra_sect_elem *) malloc (sizeof(struct ra_sect_elem));
-    if (rasect == NULL) {
-    	PANIC("No space for a new ra_sect_elem.");
-    	NOT_REACHED();
-    }
-    rasect->sect_n = next_sector;
-    list_push_back(&ra_sectors, &rasect->ra_elem);
-    cond_signal(&cond_ra, &monitor_ra);
-    lock_release(&monitor_ra);
 }
 
 /*! Accessor. Assumes appropriate rw_lock held. 
@@ -260,17 +606,180 @@ struct cache_meta_data *get_cache_metadata(cache_sector_id c) {
     return supplemental_filesystem_cache_table + c;
 }
 
+/*! Returns true if disk sector T is in the cache, or on its way in. Only a
+    hint, it may be evicted (or brought in) as soon as we return. */
+bool cache_contains(block_sector_t t) {
+    bool found;
+
+    lock_acquire(cache_stripe_lock(t));
+    found = cache_index_find(t, false) != NO_CACHE_SECTOR;
+    lock_release(cache_stripe_lock(t));
+
+    return found;
+}
+
+/*! Brings disk sector T, holding CLS, into the cache and keeps it there 
+    until a matching cache_unpin. For inode and indirection sectors that 
+    every access to a file goes through. Returns false, pinning nothing, if
+    T isn't pinned already and max_pinned_sectors are. */
+bool cache_pin(block_sector_t t, enum cache_sector_class cls) {
+    struct cache_meta_data *meta_walker;
+    cache_sector_id c;
+    bool pinned = true;
+
+    /* Our read lock doesn't keep it from being evicted: an evicter may
+       claim it while we hold it and wait for us to leave. So we check that
+       it still holds T, and isn't being taken from it, under the locks an
+       evicter claims it with, and try again if not. */
+    while (true) {
+        c = crab_into_cached_sector_of_class(t, true, false, cls);
+        meta_walker = supplemental_filesystem_cache_table + c;
+
+        lock_acquire(&cache_clock_lock);
+        lock_acquire(cache_stripe_lock(t));
+        if (meta_walker->current_disk_sector == t &&
+            !meta_walker->cache_sector_evicters_ignore)
+            break;
+        lock_release(cache_stripe_lock(t));
+        lock_release(&cache_clock_lock);
+        crab_outof_cached_sector(c, true);
+    }
+
+    if (meta_walker->pin_count == 0) {
+        if (pinned_sectors < max_pinned_sectors)
+            pinned_sectors++;
+        else
+            pinned = false;
+    }
+    if (pinned)
+        meta_walker->pin_count++;
+    else
+        pins_refused++;
+    lock_release(cache_stripe_lock(t));
+    lock_release(&cache_clock_lock);
+
+    crab_outof_cached_sector(c, true);
+    return pinned;
+}
+
+/*! Undoes a successful cache_pin of disk sector T. */
+void cache_unpin(block_sector_t t) {
+    struct cache_meta_data *meta_walker;
+    cache_sector_id c;
+
+    lock_acquire(&cache_clock_lock);
+    lock_acquire(cache_stripe_lock(t));
+
+    /* Pinned, so it can't have gone anywhere. */
+    c = cache_index_find(t, false);
+    ASSERT(c != NO_CACHE_SECTOR);
+    meta_walker = supplemental_filesystem_cache_table + c;
+    ASSERT(meta_walker->pin_count > 0);
+    if (--meta_walker->pin_count == 0)
+        pinned_sectors--;
+
+    lock_release(cache_stripe_lock(t));
+    lock_release(&cache_clock_lock);
+}
+
+/*! Returns true if disk sector T is in the cache, on its way in, or on its
+    way out. Only a hint, like cache_contains. */
+static bool cache_holds(block_sector_t t) {
+    bool found;
+
+    lock_acquire(cache_stripe_lock(t));
+    found = cache_index_find(t, false) != NO_CACHE_SECTOR ||
+            cache_index_find(t, true) != NO_CACHE_SECTOR;
+    lock_release(cache_stripe_lock(t));
+
+    return found;
+}
+
+/*! Copies disk sector T to or from the cache sector holding it, reading it
+    into BUFFER if READNOTWRITE, otherwise writing BUFFER over it. */
+static void copy_through_cache(block_sector_t t, void *buffer, 
+    bool readnotwrite) {
+
+    cache_sector_id c = crab_into_cached_sector(t, readnotwrite, false);
+    if (readnotwrite)
+        cache_read(c, buffer, 0, BLOCK_SECTOR_SIZE);
+    else
+        cache_write(c, buffer, 0, BLOCK_SECTOR_SIZE);
+    crab_outof_cached_sector(c, readnotwrite);
+}
+
+/*! Called after writing disk sector T directly. If it was brought into the
+    cache meanwhile (say by read-ahead) it may hold what was there before,
+    so if it's still clean, reread it. If it's dirty, someone wrote it 
+    through the cache after we did, and theirs is the newer data. */
+static void refresh_cached_sector(block_sector_t t) {
+    struct cache_meta_data *meta_walker;
+    cache_sector_id c;
+
+    if (!cache_holds(t))
+        return;
+
+    /* As a writer, so nobody is reading it while we replace it. */
+    c = crab_into_cached_sector(t, false, false);
+    meta_walker = supplemental_filesystem_cache_table + c;
+    if (!bitmap_test(cache_dirty_bits, c))
+        pull_sector_from_disk_to_cache(t, c);
+    rw_release(&meta_walker->read_write_diskio_lock, false, false);
+}
+
+/*! Moves the CNT disk sectors starting at T, at most CACHE_MAX_RUN, between 
+    disk and BUFFER, which has room for them all. Reads them into BUFFER if
+    READNOTWRITE, otherwise writes BUFFER to them. 
+
+    Sectors the cache doesn't hold move straight between disk and BUFFER, 
+    each stretch of them in one request, and are not brought into the 
+    cache. Those it does hold might be newer than disk, or the other way
+    round once we write, so they are copied through the cache instead. */
+void cache_direct_io(block_sector_t t, size_t cnt, void *buffer,
+    bool readnotwrite) {
+
+    void *buffers[CACHE_MAX_RUN];
+    uint8_t *walker = buffer;
+    size_t i, n;
+
+    ASSERT(cnt <= CACHE_MAX_RUN);
+
+    while (cnt > 0) {
+        if (cache_holds(t)) {
+            copy_through_cache(t, walker, readnotwrite);
+            direct_cached_sectors++;
+            n = 1;
+        } else {
+            for (n = 0; n < cnt && (n == 0 || !cache_holds(t + n)); n++)
+                buffers[n] = walker + n * BLOCK_SECTOR_SIZE;
+
+            if (readnotwrite) {
+                block_read_multiple(fs_device, t, n, buffers);
+            } else {
+                block_write_multiple(fs_device, t, n, buffers);
+                for (i = 0; i < n; i++)
+                    refresh_cached_sector(t + i);
+            }
+            direct_sectors += n;
+        }
+
+        t += n;
+        cnt -= n;
+        walker += n * BLOCK_SECTOR_SIZE;
+    }
+}
+
 /*! Must be called after acquiring a r/w lock. Verifies that the intended
     disk sector is in residence in the cache sector locked. Given that
     the r/w lock is held, there is no question of the cache being in-eviction 
     so we don't bother checking the old disk sector. */
 bool is_disk_sector_in_cache (cache_sector_id c, block_sector_t t) {        
     bool result = false;
-    lock_acquire(&allow_cache_sweeps);
+    lock_acquire(cache_stripe_lock(t));
     if ((supplemental_filesystem_cache_table+c)->current_disk_sector == t) {
         result = true;
     } 
-    lock_release(&allow_cache_sweeps);
+    lock_release(cache_stripe_lock(t));
     return result;
 }
 
@@ -303,77 +812,63 @@ bool is_disk_sector_in_cache (cache_sector_id c, block_sector_t t) {
     and if the block isn't found in cache (e.g. after a file removal, and
     reallocation of blocks), an eviction is performed, but nothing new is
     brought in.
+
+    CLS says what the sector holds, which the replacement policy uses to 
+    keep index blocks and inodes around longer than file data.
     */
-cache_sector_id crab_into_cached_sector(block_sector_t t, bool readnotwrite, 
-    	bool extending) {
+cache_sector_id crab_into_cached_sector_of_class(block_sector_t t, 
+        bool readnotwrite, bool extending, enum cache_sector_class cls) {
     
     cache_sector_id target;
+    bool loaded = false;
     struct cache_meta_data *meta_walker;
-    bool free_sector_allocated;
+    struct lock *stripe = cache_stripe_lock(t);
 
     while (true) {        
     
         /*
-        Acquire the cache sweep lock.    
-        Check to see whether the block sector requested is in our cache
-            Might be in middle of eviction, pull-in, read-ahead, write-behind
-            or deletion - be careful.
-        Release the cache sweep lock
+        Acquire the stripe lock for t.
+        Probe the index to see whether the block sector requested is in our
+            cache. Might be in middle of eviction, pull-in, read-ahead, 
+            write-behind or deletion - be careful.
+        Release the stripe lock
         */
     
-        target = NUM_DISK_SECTORS_CACHED; /* Nonsense */
-        meta_walker = supplemental_filesystem_cache_table; /* Base */
-    
-        lock_acquire(&allow_cache_sweeps);
-    
-        int k;
-        for (k = 0; k < NUM_DISK_SECTORS_CACHED; k++) {        
-    
-            if (!meta_walker->cache_sector_free) {                
+        lock_acquire(stripe);
     
-                if ( (!meta_walker->cache_sector_evicters_ignore &&
-                        (meta_walker->current_disk_sector == t) ) ||
-                    (meta_walker->cache_sector_evicters_ignore &&
-                                (meta_walker->old_disk_sector == t) ) ) {
-                    /*  Either this has my sector of interest, or
-                        it's about to be evicted and it still contains
-                        my sector of interest, and I might be able to 
-                        worm my way in, or it is evicting (or doing some
-                        other blocking io) and I will block on this, and 
-                        be woken when it's safe to bring my sector back in
-                        again. */                         
-                    target = meta_walker->cid;                    
-                    break;
-                } 
-
-                if (meta_walker->cache_sector_evicters_ignore && 
-                        (meta_walker->current_disk_sector == t) ) {
-                    /*  When this sector finishes io, it will contain
-                        my sector of interest. However, it does not contain
-                        it right now. Therefore, I should block on its
-                        pending_io lock till it's done. */
-                	lock_release(&allow_cache_sweeps);
-                    lock_acquire(&meta_walker->pending_io_lock);
-                    lock_acquire(&allow_cache_sweeps);
-                    /*  Immediately release the lock and try to crab
-                        for my sector again. This will wake
-                        up others waiting on this lock. */
-                    lock_release(&meta_walker->pending_io_lock);
-
-                    target = meta_walker->cid;
-                    break;
-                }
+        /*  Either this has my sector of interest, or it's about to be evicted
+            and it still contains my sector of interest, and I might be able
+            to worm my way in, or it is evicting (or doing some other 
+            blocking io) and I will block on this, and be woken when it's 
+            safe to bring my sector back in again. */
+        target = cache_index_find(t, true);
+
+        if (target == NO_CACHE_SECTOR) {
+            target = cache_index_find(t, false);
+            meta_walker = supplemental_filesystem_cache_table + target;
+
+            if (target != NO_CACHE_SECTOR && 
+                    meta_walker->cache_sector_evicters_ignore) {
+                /*  When this sector finishes io, it will contain
+                    my sector of interest. However, it does not contain
+                    it right now. Therefore, I should block on its
+                    pending_io lock till it's done. 
+
+                    Don't hold the stripe lock while holding pending_io_lock,
+                    an evicter might be holding the stripe lock and waiting
+                    for pending_io_lock. Release the lock immediately. This
+                    will wake up others waiting on this lock. */
+                lock_release(stripe);
+                wait_for_pending_io(meta_walker);
+                lock_acquire(stripe);
             }
+        }
     
-            meta_walker += 1;
-    
-        }        
-    
+        lock_release(stripe);
+
         meta_walker = supplemental_filesystem_cache_table; /* Base */
 
-        if (target < NUM_DISK_SECTORS_CACHED) {
-            
-            lock_release(&allow_cache_sweeps);   
+        if (target != NO_CACHE_SECTOR) {
 
             /*
                 The block sector was in our cache
@@ -385,9 +880,9 @@ cache_sector_id crab_into_cached_sector(block_sector_t t, bool readnotwrite,
 
             /* Read = True, Write = False */
             /* DiskIO = True, CacheRW = False */
-            rw_acquire(&(meta_walker+target)->read_write_diskio_lock,
-                        readnotwrite, 
-                        false); 
+            acquire_io_lock(&(meta_walker+target)->read_write_diskio_lock,
+                            readnotwrite, 
+                            false); 
 
             if (!is_disk_sector_in_cache(target, t)) {
                 /* We have the r/w lock but the requested disk sector is not
@@ -401,6 +896,14 @@ cache_sector_id crab_into_cached_sector(block_sector_t t, bool readnotwrite,
                 /* We have the r/w lock and the requested disk sector is in the 
                     sector "target". We're done. */
 
+                if (!loaded) {
+                    cache_hits++;
+                    if (bitmap_test_and_reset(cache_prefetched_bits, target))
+                        prefetch_used++;
+                }
+                if (cls > (meta_walker+target)->sector_class)
+                    (meta_walker+target)->sector_class = cls;
+
                 if (extending) {
                     /*  This was here from a previous owner, clear it before
                         letting the new owner see it. They think it's un-
@@ -412,68 +915,14 @@ cache_sector_id crab_into_cached_sector(block_sector_t t, bool readnotwrite,
             }            
 
         } else {
-            /*  Retain the sweep lock, because the block sector was not in our 
-                cache. We need to carefully let all other threads know we're 
-                bringing it in so no one else tries to at the same time,
-                and so no one can access the old sector thinking it's new 
-                sector!
-                        
-                Draft a free cache sector 
-                    Set evicters_ignore flag to true                    
-                    Set (current, old) disk sectors to (t, SILLY)
-                    Acquire the (guaranteed free) pending_io_lock               
-                or 
-                Prep a used, not-ignored-by-evictors cache sector for eviction
-                    Set evicters_ignore flag to true
-                    Set (current, old) disk sectors to (t, current)
-                    Acquire the (guaranteed free) pending_io_lock
-
-                    Nothing about the cache data has changed, and incoming
-                    readers/writers for the old sector can still correctly
-                    read/write the cache. Incoming readers/writers for the 
-                    new sector will see that there is a cache sector
-                    for their target, but that it's in the process 
-                    of disk io. However, we haven't acquired a disk io lock
-                    yet (or even put ourselves in the queue, with priority)
-                    so these incoming must be prevented from accessing the 
-                    cache sector, which has another sector's data. That's 
-                    the reason for the pending_io_lock shenanigans.
-
-                Release the sweep lock
-            */
-        
-            free_sector_allocated = try_allocating_free_cache_sector(&target, 
-                                                                        t);
-            
-            if (!free_sector_allocated) {
-                select_cache_sector_for_eviction(&target, t);
-            }
-            
-            lock_release(&allow_cache_sweeps);
-
-            /*
-                Acquire a disk io lock on that sector  
-                Release the pending_io_lock
-
-                    This will force incoming and blocked readers/writers to 
-                    wait till we're done, but allows current readers/writers 
-                    to finish.                                         
-            */
-
-            /* IRRELEVANT: Read = True, Write = False */
-            /* DiskIO = True, CacheRW = False */
-            rw_acquire(&(meta_walker+target)->read_write_diskio_lock,
-                        true,
-                        true);
-
-            lock_release(&(meta_walker+target)->pending_io_lock);
-
-            /* Evict/Load as necessary */
-
-            if (!free_sector_allocated) {
-                /* Proceed with Eviction */
-                evict_cached_sector(target);
-            } 
+            /*  The block sector was not in our cache. Claim a cache sector
+                for it, evicting whatever was there, or find someone else 
+                got t into the index since our probe, in which case we just 
+                try again. See claim_cache_sector_for_load. */
+            if (!claim_cache_sector_for_load(t, cls, false, &target))
+                continue;
+            loaded = true;
+            cache_misses++;
 
             /* Bring in the relevant data from disk if necessary */        
             if (extending) {
@@ -485,37 +934,164 @@ cache_sector_id crab_into_cached_sector(block_sector_t t, bool readnotwrite,
                 pull_sector_from_disk_to_cache(t, target);
             }            
 
-            /*    
-                Acquire a sweep lock                                
-                    Set the evictors_ignore to false
-                    Set accessed and dirty to false
-                    Remove the old_disk_sector and set it to SILLY
-                    Release the disk io lock 
-                Release the sweep lock
+            /*  Go to start of loop to try and acquire a cache rw lock on the
+                updated sector. */
+            finish_load(t, target, extending, false);
+        }
 
-                Go to start of loop to try and acquire a 
-                    cache rw lock on the updated sector            
-            */                    
+    }
 
-            lock_acquire(&allow_cache_sweeps);
+    return target;
+}
 
-            (meta_walker+target)->cache_sector_evicters_ignore = false;
-            (meta_walker+target)->cache_sector_accessed = false;
-            (meta_walker+target)->cache_sector_dirty = extending;
-            (meta_walker+target)->old_disk_sector = SILLY_OLD_DISK_SECTOR;
+/*! Claims a cache sector for disk sector T, of class CLS, and sets *C to
+    it, ready to have T read into it. Returns false, claiming nothing, if T
+    turned out to be in the cache already.
+
+    We need to carefully let all other threads know we're bringing it in so
+    no one else tries to at the same time, and so no one can access the 
+    old sector thinking it's new sector! See reserve_cache_sector, which 
+    (with both stripe locks held) either
+
+        Drafts a free cache sector 
+            Set evicters_ignore flag to true                    
+            Set (current, old) disk sectors to (t, SILLY)
+            Acquire the (guaranteed free) pending_io_lock               
+        or 
+        Preps a used, not-ignored-by-evictors cache sector for eviction
+            Set evicters_ignore flag to true
+            Set (current, old) disk sectors to (t, current)
+            Acquire the (guaranteed free) pending_io_lock
+
+            Nothing about the cache data has changed, and incoming
+            readers/writers for the old sector can still correctly
+            read/write the cache. Incoming readers/writers for the 
+            new sector will see that there is a cache sector
+            for their target, but that it's in the process 
+            of disk io. However, we haven't acquired a disk io lock
+            yet (or even put ourselves in the queue, with priority)
+            so these incoming must be prevented from accessing the 
+            cache sector, which has another sector's data. That's 
+            the reason for the pending_io_lock shenanigans.
+
+    Then we 
+        Acquire a disk io lock on that sector  
+        Release the pending_io_lock
+
+            This will force incoming and blocked readers/writers to 
+            wait till we're done, but allows current readers/writers 
+            to finish.                                         
+
+        Evict the old sector, if there was one.
+
+    If NOWAIT is set, we also return false, claiming nothing, rather than
+    wait for the io lock of the sector we'd evict. Callers holding other 
+    io locks must use it. */
+static bool claim_cache_sector_for_load(block_sector_t t, 
+    enum cache_sector_class cls, bool nowait, cache_sector_id *c) {
 
-            /* IRRELEVANT: Read = True, Write = False */
-            /* DiskIO = True, CacheRW = False */
-            rw_release(&(meta_walker+target)->read_write_diskio_lock,
-                        true,
-                        true);
+    struct cache_meta_data *meta_walker;
+    bool free_sector_allocated;
 
-            lock_release(&allow_cache_sweeps);
-        }
+    if (!reserve_cache_sector(t, cls, nowait, c, &free_sector_allocated))
+        return false;
 
+    meta_walker = supplemental_filesystem_cache_table + *c;
+    if (!nowait) {
+        /* IRRELEVANT: Read = True, Write = False */
+        /* DiskIO = True, CacheRW = False */
+        acquire_io_lock(&meta_walker->read_write_diskio_lock, true, true);
+        lock_release(&meta_walker->pending_io_lock);
     }
 
-    return target;
+    if (!free_sector_allocated) {
+        /* Proceed with Eviction */
+        evict_cached_sector(*c);
+    } 
+
+    return true;
+}
+
+/*! Finishes bringing disk sector T into cache sector C, claimed with 
+    claim_cache_sector_for_load, once its data is in place. DIRTY says 
+    whether the data still has to be written to disk, and PREFETCH whether
+    read-ahead brought it in.
+
+    Acquire the stripe locks for the old and new disk sectors
+        Set the evictors_ignore to false
+        Set accessed to false
+        Remove the old_disk_sector and set it to SILLY
+        Release the disk io lock 
+    Release the stripe locks */
+static void finish_load(block_sector_t t, cache_sector_id c, bool dirty,
+    bool prefetch) {
+
+    struct cache_meta_data *meta_walker = supplemental_filesystem_cache_table+c;
+    block_sector_t old_disk_sector = meta_walker->old_disk_sector;
+
+    cache_lock_stripes(t, old_disk_sector);
+
+    meta_walker->cache_sector_evicters_ignore = false;
+    bitmap_reset(cache_accessed_bits, c);
+    if (dirty)
+        mark_cache_sector_as_dirty(c);
+    else
+        mark_cache_sector_as_clean(c);
+    bitmap_set(cache_prefetched_bits, c, prefetch);
+    if (old_disk_sector != SILLY_OLD_DISK_SECTOR)
+        cache_index_remove(old_disk_sector, c, true);
+    meta_walker->old_disk_sector = SILLY_OLD_DISK_SECTOR;
+
+    /* IRRELEVANT: Read = True, Write = False */
+    /* DiskIO = True, CacheRW = False */
+    rw_release(&meta_walker->read_write_diskio_lock, true, true);
+
+    cache_unlock_stripes(t, old_disk_sector);
+}
+
+/*! Crabs into disk sector T holding file data. See 
+    crab_into_cached_sector_of_class. */
+cache_sector_id crab_into_cached_sector(block_sector_t t, bool readnotwrite, 
+    	bool extending) {
+    return crab_into_cached_sector_of_class(t, readnotwrite, extending,
+                                            CACHE_CLASS_DATA);
+}
+
+/*! Brings the CNT file data sectors starting at T into the cache for
+    read-ahead, skipping those already there. Each stretch of them we can
+    claim cache sectors for without waiting, at most max_prefetch_run, is
+    read with one request. */
+void cache_prefetch(block_sector_t t, size_t cnt) {
+    cache_sector_id run[CACHE_MAX_RUN];
+    void *buffers[CACHE_MAX_RUN];
+    size_t i, n;
+
+    while (cnt > 0) {
+        for (n = 0; n < cnt && n < max_prefetch_run; n++) {
+            /* Only the first claim may wait, we hold the rest's io locks. */
+            if (cache_contains(t + n) ||
+                !claim_cache_sector_for_load(t + n, CACHE_CLASS_DATA, n > 0,
+                                             &run[n]))
+                break;
+            buffers[n] = supplemental_filesystem_cache_table[run[n]].
+                            head_of_sector_in_memory;
+        }
+
+        if (n == 0) {
+            /* Already cached (or on its way in). */
+            t++;
+            cnt--;
+            continue;
+        }
+
+        block_read_multiple(fs_device, t, n, buffers);
+        for (i = 0; i < n; i++)
+            finish_load(t + i, run[i], false, true);
+        prefetch_issued += n;
+
+        t += n;
+        cnt -= n;
+    }
 }
 
 /*! The read/write/io lock interface in synch.c handles fairness and access
@@ -537,150 +1113,309 @@ void crab_outof_cached_sector(cache_sector_id c, bool readnotwrite) {
                 false); 
 }
 
-/*! Tries to allocate a free sector, if one exists in our cache. 
+/*! Finds a cache sector to bring disk sector T into, and claims it for T.
 
-    Prior to entry, a sweep lock must be acquired.
+    Acquires cache_clock_lock, so only one thread at a time picks victims. 
+    Takes a free cache sector if there is one, otherwise picks a victim by
+    our eviction policy. Then, with the stripe locks for T and for the 
+    victim's disk sector held, makes sure nobody got T into the index since
+    the caller's probe, and that the victim hasn't been taken over for io
+    by someone else (e.g. write-behind) since we picked it.
 
-    Searches for free cache sectors
-    Picks the first it finds.
+    On success, the cache sector is claimed for T exactly as described in
+    crab_into_cached_sector, its pending_io_lock is held, *C is set to it, and
+    *FREE_SECTOR_ALLOCATED says whether it was free (nothing to evict). 
+    The replacement policy is told it now holds T, of class CLS.
 
-    Sets cache_sector_free to false    
-    Set evicters_ignore flag to true                    
-    Set (current, old) disk sectors to (t, SILLY)
-    Acquire the (guaranteed free) pending_io_lock               
+    If NOWAIT is set, the io lock of the cache sector is acquired here 
+    rather than the pending_io_lock, and if that can't be done without 
+    waiting, or there is nothing we could evict, we give up, claiming 
+    nothing.
 
-    The cache_sector_id pointer c is set to the index in 
-    0..NUM_DISK_SECTORS_CACHED-1 that was found free, on success.
+    Returns false, claiming nothing, if T is already in the index. */
+static bool reserve_cache_sector(block_sector_t t, 
+    enum cache_sector_class cls, bool nowait, cache_sector_id *c, 
+    bool *free_sector_allocated) {
 
-    Returns false on failure, true on success. */
-bool try_allocating_free_cache_sector(cache_sector_id* c, block_sector_t t) {
-    
-    bool result = false;    
     struct cache_meta_data *meta_walker;
-    
-    meta_walker = supplemental_filesystem_cache_table; /* Base */
-    
-    int k;
-    for (k = 0; k < NUM_DISK_SECTORS_CACHED; k++) {        
-        if (meta_walker->cache_sector_free) {            
+    block_sector_t victim_disk_sector;
+    bool reserved = false;
+
+    lock_acquire(&cache_clock_lock);
+
+    while (true) {
+        *c = try_allocating_free_cache_sector();
+        *free_sector_allocated = *c != NO_CACHE_SECTOR;
+        if (!*free_sector_allocated) {
+            if (!nowait)
+                *c = select_cache_sector_for_eviction();
+            else if ((*c = try_selecting_cache_sector_for_eviction()) ==
+                     NO_CACHE_SECTOR)
+                break;
+        }
+
+        meta_walker = supplemental_filesystem_cache_table + *c;
+        victim_disk_sector = *free_sector_allocated ? 
+            SILLY_OLD_DISK_SECTOR : meta_walker->current_disk_sector;
+
+        cache_lock_stripes(t, victim_disk_sector);
+
+        if (cache_index_find(t, true) != NO_CACHE_SECTOR ||
+            cache_index_find(t, false) != NO_CACHE_SECTOR) {
+            /* Someone beat us to it, go crab into theirs. */
+            cache_unlock_stripes(t, victim_disk_sector);
+            break;
+        }
+
+        if (nowait &&
+            (meta_walker->cache_sector_evicters_ignore ||
+             meta_walker->current_disk_sector != victim_disk_sector ||
+             meta_walker->pin_count > 0 ||
+             !rw_try_acquire_io(&meta_walker->read_write_diskio_lock))) {
+            /* Busy, and we can't wait for it. */
+            cache_unlock_stripes(t, victim_disk_sector);
+            break;
+        }
+
+        if (*free_sector_allocated) {
+            next_free_cache_sector++;
             meta_walker->cache_sector_free = false;
             meta_walker->cache_sector_evicters_ignore = true;
             meta_walker->current_disk_sector = t;
             meta_walker->old_disk_sector = SILLY_OLD_DISK_SECTOR;
-            lock_acquire(&meta_walker->pending_io_lock);
-            *c = meta_walker->cid;
-            result = true;
-            break;
+            cache_index_insert(t, *c, false);
+            if (!nowait)
+                lock_acquire(&meta_walker->pending_io_lock);
+            reserved = true;
+        } else if (!meta_walker->cache_sector_evicters_ignore &&
+                   meta_walker->current_disk_sector == victim_disk_sector &&
+                   meta_walker->pin_count == 0) {
+            meta_walker->cache_sector_evicters_ignore = true;
+            meta_walker->old_disk_sector = victim_disk_sector;
+            meta_walker->current_disk_sector = t;
+
+            /* Refile under the sector coming in, and keep the one 
+               going out findable till the eviction completes. */
+            cache_index_remove(victim_disk_sector, *c, false);
+            cache_index_insert(victim_disk_sector, *c, true);
+            cache_index_insert(t, *c, false);
+
+            if (!nowait)
+                lock_acquire(&meta_walker->pending_io_lock);
+            reserved = true;
         }
 
-        meta_walker += 1;
+        cache_unlock_stripes(t, victim_disk_sector);
+
+        if (reserved) {
+            cache_policy_admit(*c, t, victim_disk_sector, cls);
+            if (!*free_sector_allocated &&
+                bitmap_test_and_reset(cache_prefetched_bits, *c))
+                prefetch_wasted++;
+            break;
+        }
+        /* The victim changed hands while we weren't looking. Pick again. */
     }
-    
-    return result;
+
+    lock_release(&cache_clock_lock);
+    return reserved;
 }
 
-/*! Implements clock eviction policy. 
+/*! Looks for a free sector, if one exists in our cache. 
 
-    Prior to entry, cache has been locked from sweeps and we've tried
-    to allocate a free cache sector.
+    Prior to entry, cache_clock_lock must be acquired.
 
-    Therefore, we can safely assume there are no free cache entries while
-    we execute this call.
+    Returns the next never-used cache sector, in 
+    0..num_disk_sectors_cached-1, or NO_CACHE_SECTOR if they've all been
+    used. The sector is not claimed, see reserve_cache_sector. */
+cache_sector_id try_allocating_free_cache_sector(void) {
     
-    Preps a used, not-ignored-by-evictors cache sector for eviction
-    Panics, for now, if none are found.
-        Set evicters_ignore flag to true
-        Set (current, old) disk sectors to (t, current)
-        Acquire the (guaranteed free) pending_io_lock
+    if (next_free_cache_sector >= num_disk_sectors_cached)
+        return NO_CACHE_SECTOR;
 
-    Currently, returns the first such non-accessed sector it finds, moving the 
-    global clock hand appropriately. 
+    ASSERT(supplemental_filesystem_cache_table[next_free_cache_sector].
+                cache_sector_free);
+    return next_free_cache_sector;
+}
 
-    If no non-accessed sectors are found, returns the first.
-    
-    ==TODO==    
-    Look for unpinned sectors that are not dirty or metadata, first.
-        If some are found, but all are accessed, toss the first.
-        Otherwise toss the first non-accessed one. 
-    If none are found, look for unpinned sectors that are dirty.
-        If some are found, but all are accessed, toss the first.
-        Otherwise toss the first non-accessed one. 
-    If none are found, all sectors are inode-style metadata.
-        If some are found, but all are accessed, toss the first.
-        Otherwise toss the first non-accessed one. 
-
-*/
-void select_cache_sector_for_eviction(cache_sector_id *c, block_sector_t t) {    
-    
-    bool found_an_eviction_candidate = false;  
+/*! Remembers disk sector T, just evicted from probation, in the 2Q ghost
+    ring, forgetting the oldest if it's full. */
+static void ghost_remember(block_sector_t t) {
+    if (ghost_count == ghost_capacity)
+        ghost_counts[ghost_ring[ghost_next] & ghost_mask]--;
+    else
+        ghost_count++;
+
+    ghost_ring[ghost_next] = t;
+    ghost_counts[t & ghost_mask]++;
+    if (++ghost_next >= ghost_capacity)
+        ghost_next = 0;
+}
+
+/*! Returns true if disk sector T was (probably) evicted from probation 
+    recently. */
+static bool ghost_recalls(block_sector_t t) {
+    return ghost_counts[t & ghost_mask] != 0;
+}
 
-    bool firstPass = true; /* Is this our first pass through the cache? */
+/*! Tells the replacement policy that cache sector C has just been claimed 
+    for disk sector T of class CLS, replacing disk sector OLD (or 
+    SILLY_OLD_DISK_SECTOR if C was free). Must be called with 
+    cache_clock_lock held. */
+static void cache_policy_admit(cache_sector_id c, block_sector_t t, 
+    block_sector_t old, enum cache_sector_class cls) {
+
+    struct cache_meta_data *meta_walker = supplemental_filesystem_cache_table+c;
+
+    if (meta_walker->on_probation) {
+        list_remove(&meta_walker->probation_elem);
+        meta_walker->on_probation = false;
+        probation_count--;
+        ghost_remember(old);
+    }
+
+    meta_walker->sector_class = cls;
+
+    if (cache_policy == CACHE_POLICY_2Q && cls == CACHE_CLASS_DATA &&
+        !ghost_recalls(t)) {
+        list_push_back(&probation_queue, &meta_walker->probation_elem);
+        meta_walker->on_probation = true;
+        probation_count++;
+    }
+}
+
+/*! Picks the oldest cache sector on 2Q probation, or returns NO_CACHE_SECTOR
+    if there isn't one we can evict. Sectors in the middle of io are moved to
+    the back of the queue, and sectors that turned out to be index blocks or
+    inodes since they came in are promoted to the main clock. */
+static cache_sector_id select_from_probation(void) {
 
     struct cache_meta_data *meta_walker;
+    uint32_t k, n = probation_count;
+
+    for (k = 0; k < n && !list_empty(&probation_queue); k++) {
+        meta_walker = list_entry(list_front(&probation_queue), 
+                                 struct cache_meta_data, probation_elem);
+
+        if (meta_walker->cache_sector_evicters_ignore ||
+            meta_walker->pin_count > 0) {
+            list_push_back(&probation_queue, list_pop_front(&probation_queue));
+        } else if (meta_walker->sector_class != CACHE_CLASS_DATA) {
+            list_pop_front(&probation_queue);
+            meta_walker->on_probation = false;
+            probation_count--;
+        } else {
+            return meta_walker->cid;
+        }
+    }
+
+    return NO_CACHE_SECTOR;
+}
+
+/*! Returns how much we'd rather keep cache sector C, lowest first: clean
+    file data 0, dirty file data 1, then one more for each class of 
+    metadata, indirection blocks before inodes. */
+static int eviction_rank(cache_sector_id c) {
+    enum cache_sector_class cls = 
+        supplemental_filesystem_cache_table[c].sector_class;
+
+    if (cls == CACHE_CLASS_DATA)
+        return bitmap_test(cache_dirty_bits, c) ? 1 : 0;
+    return 1 + (int) cls;
+}
+
+/*! Sweeps the clock hand around the cache for a victim, clearing the 
+    accessed bits it passes over (second chance). 
     
+    With plain clock, returns the first non-accessed sector, or failing that
+    the first sector. With TWO_Q, sectors on probation are skipped, and lap
+    N only takes sectors of eviction_rank N or less, so clean file data goes
+    first, then dirty data, then indirection blocks, then inodes, each 
+    getting an extra lap over the last. 
+    
+    Returns NO_CACHE_SECTOR if everything is ignored by evicters. */
+static cache_sector_id select_by_clock(bool two_q) {
+
+    struct cache_meta_data *meta_walker;
+    bool accessed;
+    int pass, last_pass;
+    uint32_t k;
+
     meta_walker = supplemental_filesystem_cache_table; /* Base */
+    last_pass = two_q ? 2 + (int) CACHE_CLASS_INODE : 1;
 
-    while (!found_an_eviction_candidate) {
-        
-        int k;
-        for (k = 0; k < NUM_DISK_SECTORS_CACHED; k++) {            
-            
-            if (    !meta_walker[cache_head].cache_sector_evicters_ignore ) {
-                
-                if (!firstPass || (firstPass && 
-                        !(meta_walker+cache_head)->cache_sector_accessed ) ) {
-                    
-                    (meta_walker+cache_head)->cache_sector_evicters_ignore = 
-                        true;
-                    
-                    (meta_walker+cache_head)->old_disk_sector = 
-                        (meta_walker+cache_head)->current_disk_sector;
-                    
-                    (meta_walker+cache_head)->current_disk_sector = t;
-        
-                    lock_acquire(&(meta_walker+cache_head)->pending_io_lock);  
-                    
-                    *c = cache_head;
-
-                    update_head();        
-
-                    found_an_eviction_candidate = true;
-
-                    break;
-        
-                }                
-        
-            } 
-            
-            update_head();            
-        
+    for (pass = 0; pass <= last_pass; pass++) {
+        for (k = 0; k < num_disk_sectors_cached; k++) {
+            cache_sector_id c = cache_head;
+
+            update_head();
+
+            if (meta_walker[c].cache_sector_evicters_ignore ||
+                meta_walker[c].pin_count > 0 ||
+                (two_q && meta_walker[c].on_probation))
+                continue;
+
+            accessed = bitmap_test_and_reset(cache_accessed_bits, c);
+
+            if (pass == last_pass || 
+                (!accessed && (!two_q || eviction_rank(c) <= pass)))
+                return c;
         }
-        
-        if (firstPass)
-            firstPass = false;
-        else
-            break;
-    
     }
 
-    ASSERT(found_an_eviction_candidate);        
+    return NO_CACHE_SECTOR;
 }
 
-/*! Write a sector (c) from the cache to the disk at sector (t).    
+/*! Implements our eviction policy, clock or 2Q as chosen at boot. 
+
+    Prior to entry, cache_clock_lock has been acquired and we've tried
+    to allocate a free cache sector.
+
+    Therefore, we can safely assume there are no free cache entries while
+    we execute this call.
     
-    Assumes cache sector is not free.
-    Assumes cache_sector_evicters_ignore is set prior to entry. 
-    Assumes an io lock has been granted prior to entry. 
-        Implies no current readers/writers have locks on this data.
-    Does not touch cache meta-data or release any locks.
+    Picks a used, not-ignored-by-evictors cache sector for eviction.
+    If every sector is pinned or claimed for io, lets go of cache_clock_lock
+    and sleeps a tick at a time till one is released, since the threads 
+    holding them may need the lock to finish. The flags are read without
+    stripe locks, so this is only a suggestion; reserve_cache_sector double
+    checks it before claiming it. */
+cache_sector_id select_cache_sector_for_eviction(void) {    
+    
+    cache_sector_id c;
 
-    This function will either succeed of panic the kernel. */
-void push_sector_from_cache_to_disk(block_sector_t t, cache_sector_id c) {    
-    block_write(
-        fs_device, 
-        t, 
-        (supplemental_filesystem_cache_table+c)->head_of_sector_in_memory
-        );
+    while ((c = try_selecting_cache_sector_for_eviction()) ==
+           NO_CACHE_SECTOR) {
+        lock_release(&cache_clock_lock);
+        timer_sleep(1);
+        lock_acquire(&cache_clock_lock);
+    }
+    return c;
+}
+
+/*! Like select_cache_sector_for_eviction, but returns NO_CACHE_SECTOR if
+    every sector is pinned or ignored by evicters, for callers that would 
+    rather do without.
+
+    With 2Q, evicts from probation while it is over its target size, and
+    otherwise from the main clock, preferring clean data, then dirty data,
+    then indirection blocks, then inodes. */
+static cache_sector_id try_selecting_cache_sector_for_eviction(void) {
+
+    cache_sector_id c = NO_CACHE_SECTOR;
+
+    if (cache_policy == CACHE_POLICY_2Q) {
+        if (probation_count > probation_target)
+            c = select_from_probation();
+        if (c == NO_CACHE_SECTOR)
+            c = select_by_clock(true);
+        if (c == NO_CACHE_SECTOR)
+            c = select_from_probation();
+    } else {
+        c = select_by_clock(false);
+    }
+
+    return c;
 }
 
 /*! Bring in a sector (t) from the disk to our cache at index (c).
@@ -700,21 +1435,150 @@ void pull_sector_from_disk_to_cache(block_sector_t t, cache_sector_id c) {
         );
 }
 
+/*! Orders flush_entries by disk sector for qsort. */
+static int compare_flush_entries(const void *a_, const void *b_) {
+    block_sector_t a = ((const struct flush_entry *) a_)->sector;
+    block_sector_t b = ((const struct flush_entry *) b_)->sector;
+    return a < b ? -1 : a > b;
+}
+
+/*! Whether cache sector C has been dirty for at least dirty_expire ticks. */
+static bool dirty_expired(cache_sector_id c) {
+    return timer_ticks() - supplemental_filesystem_cache_table[c].dirtied_at >=
+           dirty_expire;
+}
+
+/*! Wakes the writers waiting in cache_throttle_writer, if there are any.
+    If PASS_DONE, the write-behind thread has also just finished a pass. */
+static void release_throttled_writers(bool pass_done) {
+    if (!pass_done && writers_throttled == 0)
+        return;
+
+    lock_acquire(&throttle_lock);
+    if (pass_done)
+        write_behind_passes++;
+    cond_broadcast(&dirty_drained, &throttle_lock);
+    lock_release(&throttle_lock);
+}
+
+/*! Claims for write-back the cache sectors holding dirty disk sectors T,
+    T+1, ..., up to MAX of them, stopping at the first that isn't cached and
+    dirty, or that someone else is using. Each is flagged evicters_ignore
+    and its io lock is acquired. Stores them in RUN and returns how many.
+
+    If WAIT_FIRST is set we wait for the first sector's readers and writers 
+    to finish, otherwise we never wait, so that a caller holding other io 
+    locks can't deadlock with a thread holding one of these and waiting on
+    one of its. */
+static size_t claim_dirty_run(block_sector_t t, cache_sector_id *run,
+    size_t max, bool wait_first) {
+
+    struct cache_meta_data *meta_walker;
+    cache_sector_id c;
+    bool claimed;
+    size_t n;
+
+    for (n = 0; n < max; n++) {
+        claimed = false;
+        lock_acquire(cache_stripe_lock(t + n));
+
+        c = cache_index_find(t + n, false);
+        meta_walker = supplemental_filesystem_cache_table + c;
+        if (c != NO_CACHE_SECTOR && 
+            !meta_walker->cache_sector_evicters_ignore &&
+            bitmap_test(cache_dirty_bits, c) &&
+            ((wait_first && n == 0) || 
+             rw_try_acquire_io(&meta_walker->read_write_diskio_lock))) {
+            meta_walker->cache_sector_evicters_ignore = true;
+            claimed = true;
+        }
+
+        lock_release(cache_stripe_lock(t + n));
+
+        if (!claimed)
+            break;
+        if (wait_first && n == 0)
+            acquire_io_lock(&meta_walker->read_write_diskio_lock, true, true);
+        run[n] = c;
+    }
+
+    return n;
+}
+
+/*! Writes the N cache sectors of RUN, holding disk sectors T, T+1, ..., to
+    disk with one request, and clears their dirty bits. Their io locks must
+    be held, so nobody can dirty them again till we're done. */
+static void write_run(block_sector_t t, cache_sector_id *run, size_t n) {
+    void *buffers[CACHE_MAX_RUN];
+    size_t i;
+
+    ASSERT(n <= CACHE_MAX_RUN);
+
+    for (i = 0; i < n; i++) {
+        mark_cache_sector_as_clean(run[i]);
+        buffers[i] = supplemental_filesystem_cache_table[run[i]].
+                        head_of_sector_in_memory;
+    }
+    block_write_multiple(fs_device, t, n, buffers);
+}
+
+/*! Undoes claim_dirty_run for the N cache sectors of RUN, holding disk 
+    sectors T, T+1, .... */
+static void release_run(block_sector_t t, cache_sector_id *run, size_t n) {
+    struct cache_meta_data *meta_walker;
+    size_t i;
+
+    for (i = 0; i < n; i++) {
+        meta_walker = supplemental_filesystem_cache_table + run[i];
+        lock_acquire(cache_stripe_lock(t + i));
+        meta_walker->cache_sector_evicters_ignore = false;
+        rw_release(&meta_walker->read_write_diskio_lock, true, true);
+        lock_release(cache_stripe_lock(t + i));
+    }
+}
+
 /*! This function is called with a disk io lock held. 
     It does not release any locks or change any metadata.
 
-    We do the eviction if cache_sector_dirty is set.
+    We do the eviction if the sector's dirty bit is set, clearing it. Dirty
+    sectors following it on disk that we can claim without waiting go out
+    with it in one request, as many as are left in evict_run_budget, so
+    evictions never tie up more than CACHE_MAX_EVICT_RUN sectors besides
+    their victims.
     Replacement is not within the scope of this call. */
 void evict_cached_sector (cache_sector_id c) {
-    ASSERT(
-        (supplemental_filesystem_cache_table + c)->old_disk_sector != 
-        SILLY_OLD_DISK_SECTOR
-        );
+    cache_sector_id run[CACHE_MAX_EVICT_RUN + 1];
+    block_sector_t t = (supplemental_filesystem_cache_table + c)->
+                            old_disk_sector;
+    enum intr_level old_level;
+    size_t max, n;
 
-    if ((supplemental_filesystem_cache_table + c)->cache_sector_dirty) {
-        push_sector_from_cache_to_disk(
-            (supplemental_filesystem_cache_table + c)->old_disk_sector, c);
-    } 
+    ASSERT(t != SILLY_OLD_DISK_SECTOR);
+
+    if (!bitmap_test(cache_dirty_bits, c)) {
+        clean_evictions++;
+        return;
+    }
+
+    dirty_evictions++;
+    run[0] = c;
+
+    old_level = intr_disable();
+    max = evict_run_budget;
+    evict_run_budget = 0;
+    intr_set_level(old_level);
+
+    n = claim_dirty_run(t + 1, run + 1, max, false);
+    old_level = intr_disable();
+    evict_run_budget += max - n;
+    intr_set_level(old_level);
+
+    write_run(t, run, n + 1);
+    release_run(t + 1, run + 1, n);
+
+    old_level = intr_disable();
+    evict_run_budget += n;
+    intr_set_level(old_level);
 }
 
 /*! Flushes every dirty sector in cache to disk. 
@@ -731,6 +1595,9 @@ void evict_cached_sector (cache_sector_id c) {
     lingering read_aheads, we can safely walk through every entry acquiring
     an io lock on each, evicting it to disk, without fear we've missed
     a laggard who replaced a sector we checked already.
+
+    Dirty sectors go out in disk order (see flush_order), and runs of them
+    that are adjacent on disk go out in one request each.
     
     To handle read_aheads, which might have io_locks on things we're trying
     to flush (and which will flush them if necessary), we simply need to wait
@@ -743,47 +1610,177 @@ void evict_cached_sector (cache_sector_id c) {
 
      */
 void flush_cache_to_disk(void) {
+    flush_dirty_sectors(true);
+}
 
-    int k;
-    bool should_process;
-
-    for (k = 0; k < NUM_DISK_SECTORS_CACHED; k++) {
-        
-        should_process = false;
-
-        lock_acquire(&allow_cache_sweeps);
-        
-        if (supplemental_filesystem_cache_table[k].cache_sector_evicters_ignore) {
-            /*  ==TODO== Handle read_ahead in end-case 
-                For now, ignore this cache sector, someone else will know
-                to write it out if it's dirty */            
-        } else if (supplemental_filesystem_cache_table[k].cache_sector_dirty) {
-            should_process = true;            
-            supplemental_filesystem_cache_table[k].cache_sector_evicters_ignore=
-                true;            
-        }
+/*! Run by the write-behind thread whenever it wakes up. If the cache is
+    dirtier than the high watermark, writes dirty sectors out till it's 
+    down to the low one. Either way, writes out the sectors that have been
+    dirty for dirty_expire ticks or more. Then lets throttled writers go. */
+void cache_write_behind(void) {
+    flush_dirty_sectors(false);
+    release_throttled_writers(true);
+}
+
+/*! Called by writers, holding no cache sectors, after they've written. If 
+    the cache is dirtier than the high watermark, wakes the write-behind 
+    thread and waits for it to catch up. We wait at most one write-behind
+    pass, since the sectors it needs may be in use. */
+void cache_throttle_writer(void) {
+    unsigned pass;
+
+    if (cache_dirty_count <= dirty_high)
+        return;
+
+    lock_acquire(&throttle_lock);
+    pass = write_behind_passes;
+    filesys_wake_write_behind();
+    while (cache_dirty_count > dirty_high && pass == write_behind_passes) {
+        writers_throttled++;
+        writers_held_up++;
+        cond_wait(&dirty_drained, &throttle_lock);
+        writers_throttled--;
+    }
+    lock_release(&throttle_lock);
+}
 
-        lock_release(&allow_cache_sweeps);    
-        
-        if (should_process) {
-
-            rw_acquire(&supplemental_filesystem_cache_table[k].read_write_diskio_lock, true, true);
-            
-            if (supplemental_filesystem_cache_table[k].cache_sector_dirty) {
-                push_sector_from_cache_to_disk(
-                    supplemental_filesystem_cache_table[k].current_disk_sector, k);
-            } 
-
-            lock_acquire(&allow_cache_sweeps);
-            
-            supplemental_filesystem_cache_table[k].cache_sector_dirty = false;
-            supplemental_filesystem_cache_table[k].cache_sector_evicters_ignore = false;
-
-            rw_release(&supplemental_filesystem_cache_table[k].read_write_diskio_lock, true, true);
-            
-            lock_release(&allow_cache_sweeps);
+/*! Writes dirty sectors out in disk order (see flush_order), each run of
+    them adjacent on disk in one request. If ALL, writes every one, waiting
+    for any that are in use. Otherwise only as many as cache_write_behind
+    wants, skipping those in use, so that writers held up in 
+    cache_throttle_writer can't hold up write-behind in turn. */
+static void flush_dirty_sectors(bool all) {
+
+    cache_sector_id run[CACHE_MAX_RUN];
+    block_sector_t t, run_end;
+    size_t k, i, first, count, n;
+    bool draining;
+
+    /* The dirty bitmap is our dirty set, so we needn't look further. */
+    if (cache_dirty_count == 0)
+        return;
+
+    lock_acquire(&flush_lock);
+    draining = cache_dirty_count > dirty_high;
+
+    /*  Which stripe to lock depends on the disk sector, which could
+        change till we have the stripe lock, so claim_dirty_run looks
+        it up again. If it does change, whoever changed it is doing io 
+        on this sector and will write it out if need be. */
+    count = 0;
+    k = bitmap_scan(cache_dirty_bits, 0, 1, true);
+    while (k != BITMAP_ERROR) {
+        t = supplemental_filesystem_cache_table[k].current_disk_sector;
+        if (t != SILLY_OLD_DISK_SECTOR && 
+            (all || draining || dirty_expired(k))) {
+            flush_order[count].sector = t;
+            flush_order[count].c = k;
+            count++;
         }
+        if (++k == num_disk_sectors_cached)
+            break;
+        k = bitmap_scan(cache_dirty_bits, k, 1, true);
+    }
+    qsort(flush_order, count, sizeof *flush_order, compare_flush_entries);
+
+    for (first = 0; first < count; first++)
+        if (flush_order[first].sector >= flush_elevator)
+            break;
 
+    for (i = 0; i < count; i++) {
+        t = flush_order[(first + i) % count].sector;
+        k = flush_order[(first + i) % count].c;
+
+        /* Under the low watermark, only old sectors still have to go. */
+        if (!all && !dirty_expired(k) && 
+            !(draining && cache_dirty_count > dirty_low))
+            continue;
+
+        /*  ==TODO== Handle read_ahead in end-case 
+            For now, ignore cache sectors in the middle of io, someone else
+            will know to write them out if they're dirty. 
+
+            With the io locks held no one can be writing to the run, so
+            nobody can set a dirty bit between our clearing it and our
+            writing the sector out. */
+        n = claim_dirty_run(t, run, CACHE_MAX_RUN, all);
+        if (n == 0)
+            continue;
+        write_run(t, run, n);
+        release_run(t, run, n);
+        write_behind_sectors += n;
+        flush_elevator = run_end = t + n;
+
+        if (cache_dirty_count <= dirty_high)
+            release_throttled_writers(false);
+
+        /* Skip the sectors we just wrote along with this one. */
+        while (i + 1 < count && 
+               flush_order[(first + i + 1) % count].sector > t &&
+               flush_order[(first + i + 1) % count].sector < run_end)
+            i++;
     }
-    
+
+    lock_release(&flush_lock);
+}
+
+/*! Waits for the thread doing io on cache sector M to finish, by taking
+    and dropping its pending_io_lock, and counts the wait. */
+static void wait_for_pending_io(struct cache_meta_data *m) {
+    int64_t start = timer_ticks();
+
+    lock_acquire(&m->pending_io_lock);
+    lock_release(&m->pending_io_lock);
+
+    pending_io_waits++;
+    pending_io_wait_ticks += timer_ticks() - start;
+}
+
+/*! rw_acquire, counting the times we had to wait. */
+static void acquire_io_lock(struct rwlock *l, bool read, bool io) {
+    int64_t start = timer_ticks();
+
+    if (rw_acquire(l, read, io)) {
+        io_lock_waits++;
+        io_lock_wait_ticks += timer_ticks() - start;
+    }
+}
+
+/*! Fills in STATS with the buffer cache statistics so far. */
+void cache_get_stats(struct cache_stats *stats) {
+    stats->hits = cache_hits;
+    stats->misses = cache_misses;
+    stats->clean_evictions = clean_evictions;
+    stats->dirty_evictions = dirty_evictions;
+    stats->prefetch_issued = prefetch_issued;
+    stats->prefetch_used = prefetch_used;
+    stats->prefetch_wasted = prefetch_wasted;
+    stats->write_behind_sectors = write_behind_sectors;
+    stats->writers_throttled = writers_held_up;
+    stats->pending_io_waits = pending_io_waits;
+    stats->pending_io_wait_ticks = pending_io_wait_ticks;
+    stats->io_lock_waits = io_lock_waits;
+    stats->io_lock_wait_ticks = io_lock_wait_ticks;
+    stats->direct_sectors = direct_sectors;
+    stats->direct_cached_sectors = direct_cached_sectors;
+}
+
+/*! Prints buffer cache statistics. */
+void cache_print_stats(void) {
+    printf("Buffer cache: %llu hits, %llu misses, %s replacement\n",
+           cache_hits, cache_misses, 
+           cache_policy == CACHE_POLICY_2Q ? "2q" : "clock");
+    printf("Evictions: %llu clean, %llu dirty\n", 
+           clean_evictions, dirty_evictions);
+    printf("Read-ahead: %llu sectors prefetched, %llu used, %llu evicted "
+           "unused\n", prefetch_issued, prefetch_used, prefetch_wasted);
+    printf("Write-behind: %llu sectors written, %llu writers throttled\n",
+           write_behind_sectors, writers_held_up);
+    printf("Pinning: %u of at most %u sectors pinned, %llu pins refused\n",
+           pinned_sectors, max_pinned_sectors, pins_refused);
+    printf("Direct io: %llu sectors bypassed the cache, %llu went through "
+           "it\n", direct_sectors, direct_cached_sectors);
+    printf("Lock waits: pending io %llu (%llu ticks), sector io %llu "
+           "(%llu ticks)\n", pending_io_waits, pending_io_wait_ticks,
+           io_lock_waits, io_lock_wait_ticks);
 }
@@ -10,11 +10,50 @@
 
 /* ############# Constants ############### */
 
-/* Sizing in memory of the cache of disk sectors for files */
-#define NUM_DISK_SECTORS_CACHED 64
-#define NUM_DISK_CACHE_PAGES 8
+/* Default sizing in memory of the cache of disk sectors for files. The
+   -fs-cache kernel option overrides it at boot. */
+#define DEFAULT_DISK_SECTORS_CACHED 64
+/*! Fewest disk sectors the cache may hold, whatever -fs-cache asks for.
+    Pins (MAX_CACHE_PINNED_PERCENT) and a prefetch run each take at most a
+    quarter of the cache. The other half has room for a write-behind run,
+    the dirty neighbours evictions claim and CACHE_MIN_LOADS sectors being
+    loaded or evicted at once. Past that, evicters wait for a sector. */
+#define CACHE_MIN_LOADS 8
+#define MIN_DISK_SECTORS_CACHED \
+    (2 * (CACHE_MAX_RUN + CACHE_MAX_EVICT_RUN + CACHE_MIN_LOADS))
+/* Never give the cache more than this percentage of the free kernel pool */
+#define MAX_CACHE_PERCENT_OF_KERNEL_POOL 50
 typedef uint32_t cache_sector_id; 
 
+/*! Default dirty watermarks, in percent of the cache. Past the high one the
+    write-behind thread is woken, and writes dirty sectors out until the low
+    one, and writers are held up till it does. The -fs-dirty kernel option
+    overrides them at boot. */
+#define DEFAULT_DIRTY_HIGH_PERCENT 50
+#define DEFAULT_DIRTY_LOW_PERCENT 25
+
+/*! Default number of ticks a sector may stay dirty before write-behind 
+    writes it out anyway. The -fs-dirty-expire kernel option overrides it. */
+#define DEFAULT_DIRTY_EXPIRE_TICKS 2048
+
+/*! Most of the cache, in percent, that may be pinned at once. */
+#define MAX_CACHE_PINNED_PERCENT 25
+
+/*! Number of independently locked partitions of the cache meta^2 data. Must
+    be a power of two. */
+#define CACHE_STRIPES 16
+
+/*! Most disk sectors the cache moves to or from disk in one request. */
+#define CACHE_MAX_RUN 16
+
+/*! Most dirty neighbours all evictions together may have claimed at once to
+    write out with the sectors they evict. */
+#define CACHE_MAX_EVICT_RUN 4
+
+/*! Sentinel cache_sector_id terminating a chain in the cache index, and
+    returned by index probes that come up empty. */
+#define NO_CACHE_SECTOR (cache_sector_id) 0xFFFFFFFF
+
 /*! Sentinel value for old_disk_sector so we know it's ignorable (evictions,
     vs write-ahead, vs. normal operation). Works only because we have
     a tiny disk (8MB) cap. */
@@ -22,11 +61,24 @@ typedef uint32_t cache_sector_id;
 
 /* ############# Structures ############### */
 
+/*! What a cached disk sector holds, from least to most worth keeping. */
+enum cache_sector_class {
+    CACHE_CLASS_DATA,       /* File or directory data. */
+    CACHE_CLASS_INDIRECT,   /* Indirection block of some inode. */
+    CACHE_CLASS_INODE       /* On-disk inode. */
+};
+
+/*! Replacement policies, selected at boot with -fs-cache-policy. */
+enum cache_policy {
+    CACHE_POLICY_CLOCK,     /* Second chance clock over the whole cache. */
+    CACHE_POLICY_2Q         /* Scan resistant 2Q, see cache.c. */
+};
+
 /*! Cache Meta^2 Data, containing flags and locks useful for concurrent 
     reading/writing access, and eviction. */
 struct cache_meta_data {
 	// ------------------------- Invariants -----------------------------------
-	/* This cache sector's id, from 0 to NUM_DISK_SECTORS_CACHED-1 */
+	/* This cache sector's id, from 0 to num_disk_sectors_cached-1 */
     cache_sector_id cid;
     /*  Kernel virtual address of start of this cached sector. */
     void *head_of_sector_in_memory;
@@ -34,15 +86,15 @@ struct cache_meta_data {
     // ------------------ Critical/mutable fields -----------------------------
     /* We only allow single-sector wide allocation at a time. */
     bool cache_sector_free;
-    /* Preferentially do not evict if possible. */
-    bool cache_sector_dirty;
-    /* For basic clock eviction algorithm. */
-    bool cache_sector_accessed;
+    /* The dirty and accessed flags live in bitmaps in cache.c so they can
+       be set without a lock. */
     /* Flag saying we're currently evicting, or writing ahead,
 	   so might want to check old_disk_sector (if >= 0)
-	   as well if you are sweeping meta^2 data. also (ideally) don't try
+	   as well if you are probing meta^2 data. also (ideally) don't try
 	   to evict this again till I finish! */
     bool cache_sector_evicters_ignore;
+    /* Tick at which the sector last went from clean to dirty. */
+    long long dirtied_at;
     /* The disk sector we're evicting. */
     block_sector_t old_disk_sector;
     /* It is the disk sector we're bringing (after eviction), or have
@@ -59,21 +111,53 @@ struct cache_meta_data {
 	   just released by io-initiating thread. In this case they
 	   immediately release the lock and try crabbing in again. */
     struct lock pending_io_lock;
+    /* Number of cache_pin calls for current_disk_sector not yet undone. 
+       Pinned sectors are never evicted. Protected by the stripe lock. */
+    unsigned pin_count;
+    /* What current_disk_sector holds. Only ever upgraded while cached. */
+    enum cache_sector_class sector_class;
+    /* 2Q: on the probation queue of sectors seen only once, which are 
+       evicted first. Protected by cache_clock_lock. */
+    bool on_probation;
+    struct list_elem probation_elem;
+    /* Next cache sector in the index bucket for current_disk_sector. */
+    cache_sector_id next_by_current;
+    /* Next cache sector in the index bucket for old_disk_sector. Only
+       meaningful while this sector is being evicted. */
+    cache_sector_id next_by_old;
 };
 
-struct lock allow_cache_sweeps; 
+/*! Number of disk sectors the cache holds, fixed by file_cache_init. */
+extern uint32_t num_disk_sectors_cached;
 
 /* ############# Stubs ############### */
 
+struct cache_stats;
+
+void file_cache_configure(const char *size);
+void file_cache_configure_policy(const char *policy);
+void file_cache_configure_dirty(const char *watermarks);
+void file_cache_configure_dirty_expire(const char *ticks);
 void file_cache_init(void);
 cache_sector_id crab_into_cached_sector(block_sector_t t, bool readnotwrite,
     bool extending);
+cache_sector_id crab_into_cached_sector_of_class(block_sector_t t, 
+    bool readnotwrite, bool extending, enum cache_sector_class cls);
 void crab_outof_cached_sector(cache_sector_id c, bool readnotwrite);
 void cache_read(cache_sector_id src, void *dst, int offset, size_t bytes);
 void cache_write(cache_sector_id dst, void *src, int offset, int bytes);
 void *get_cache_sector_base_addr(cache_sector_id c);
 struct cache_meta_data *get_cache_metadata(cache_sector_id c);
 void flush_cache_to_disk(void);
-block_sector_t get_next_sector(block_sector_t curr_sector);
+void cache_write_behind(void);
+void cache_throttle_writer(void);
+void cache_print_stats(void);
+void cache_get_stats(struct cache_stats *stats);
+bool cache_contains(block_sector_t t);
+bool cache_pin(block_sector_t t, enum cache_sector_class cls);
+void cache_unpin(block_sector_t t);
+void cache_direct_io(block_sector_t t, size_t cnt, void *buffer, 
+    bool readnotwrite);
+void cache_prefetch(block_sector_t t, size_t cnt);
 
 #endif /* filesys/cache.h */
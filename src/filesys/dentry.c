@@ -0,0 +1,188 @@
+#include "filesys/dentry.h"
+#include <debug.h>
+#include <hash.h>
+#include <list.h>
+#include <string.h>
+#include "filesys/directory.h"
+#include "filesys/filesys.h"
+#include "threads/synch.h"
+
+/*! What one name in one directory resolves to. */
+struct dentry {
+    struct hash_elem elem;          /*!< In dentries, while valid. */
+    struct list_elem lru_elem;      /*!< In lru, most recently used first. */
+    block_sector_t dir;             /*!< Sector of the directory's inode. */
+    char name[NAME_MAX + 1];        /*!< Name within the directory. */
+    /*! Sector of the named inode, or BOGUS_SECTOR if the directory is
+        known to have no such name. */
+    block_sector_t sector;
+};
+
+/*! Cache of path components, so resolving a path that was resolved a
+    moment ago needn't open or scan the directories along it again.
+
+    Every entry is in lru, valid or not, and the valid ones are also in
+    dentries. The least recently used entry at the back of lru is the one
+    reused for a new name, so the cache never grows past DENTRY_CACHE_SIZE.
+    All of it is protected by dentry_lock. */
+static struct dentry dentry_pool[DENTRY_CACHE_SIZE];
+static struct hash dentries;
+static struct list lru;
+static struct lock dentry_lock;
+
+/*! Bumped by every change to a directory, in the counter its sector picks.
+    A lookup that went to disk only fills in what it found if there were no
+    changes to that counter's directories while it was looking, or it could
+    cache a name that was just added or removed under it. Changes to other
+    directories don't hold it up. */
+static unsigned generations[DENTRY_GENERATIONS];
+
+/*! Search key for hash_find, only touched with the lock held. */
+static struct dentry probe;
+
+static unsigned *generation(block_sector_t dir);
+static struct dentry *find(block_sector_t dir, const char *name);
+static void set(block_sector_t dir, const char *name, block_sector_t sector);
+
+/*! Hashes a dentry on its directory and name. */
+static unsigned dentry_hash(const struct hash_elem *e, void *aux UNUSED) {
+    const struct dentry *d = hash_entry(e, struct dentry, elem);
+    return hash_string(d->name) ^ hash_int((int) d->dir);
+}
+
+/*! Orders dentries by directory, then name. */
+static bool dentry_less(const struct hash_elem *a_, const struct hash_elem *b_,
+                        void *aux UNUSED) {
+    const struct dentry *a = hash_entry(a_, struct dentry, elem);
+    const struct dentry *b = hash_entry(b_, struct dentry, elem);
+    if (a->dir != b->dir)
+        return a->dir < b->dir;
+    return strcmp(a->name, b->name) < 0;
+}
+
+/*! Initializes the dentry cache, empty. */
+void dentry_init(void) {
+    size_t i;
+
+    lock_init(&dentry_lock);
+    list_init(&lru);
+    if (!hash_init(&dentries, dentry_hash, dentry_less, NULL))
+        PANIC("Couldn't allocate the dentry cache.");
+    for (i = 0; i < DENTRY_CACHE_SIZE; i++) {
+        dentry_pool[i].dir = BOGUS_SECTOR;
+        list_push_back(&lru, &dentry_pool[i].lru_elem);
+    }
+    for (i = 0; i < DENTRY_GENERATIONS; i++)
+        generations[i] = 0;
+}
+
+/*! Returns the current generation of the directory in sector DIR, to hand
+    to dentry_fill after looking a name in it up on disk. */
+unsigned dentry_generation(block_sector_t dir) {
+    unsigned g;
+
+    lock_acquire(&dentry_lock);
+    g = *generation(dir);
+    lock_release(&dentry_lock);
+    return g;
+}
+
+/*! Looks up NAME in the directory whose inode is in sector DIR. Returns
+    false if the cache doesn't know. Otherwise returns true and sets
+    *SECTOR to the sector of NAME's inode, or to BOGUS_SECTOR if DIR is
+    known to have no NAME. */
+bool dentry_lookup(block_sector_t dir, const char *name,
+                   block_sector_t *sector) {
+    struct dentry *d;
+
+    lock_acquire(&dentry_lock);
+    d = find(dir, name);
+    if (d != NULL) {
+        *sector = d->sector;
+        list_remove(&d->lru_elem);
+        list_push_front(&lru, &d->lru_elem);
+    }
+    lock_release(&dentry_lock);
+    return d != NULL;
+}
+
+/*! Remembers that NAME in DIR resolved to SECTOR, BOGUS_SECTOR if it
+    didn't, as found by a lookup on disk that started at GENERATION. */
+void dentry_fill(block_sector_t dir, const char *name, block_sector_t sector,
+                 unsigned generation_) {
+    lock_acquire(&dentry_lock);
+    if (generation_ == *generation(dir))
+        set(dir, name, sector);
+    lock_release(&dentry_lock);
+}
+
+/*! Records that NAME in DIR now resolves to SECTOR, or has just been
+    removed if SECTOR is BOGUS_SECTOR. Must be called after the directory
+    itself has been changed. */
+void dentry_update(block_sector_t dir, const char *name,
+                   block_sector_t sector) {
+    lock_acquire(&dentry_lock);
+    (*generation(dir))++;
+    set(dir, name, sector);
+    lock_release(&dentry_lock);
+}
+
+/*! Forgets everything about the directory in sector DIR, which is being
+    created afresh, maybe in the sector of a removed one. */
+void dentry_forget_dir(block_sector_t dir) {
+    size_t i;
+
+    lock_acquire(&dentry_lock);
+    (*generation(dir))++;
+    for (i = 0; i < DENTRY_CACHE_SIZE; i++) {
+        struct dentry *d = &dentry_pool[i];
+        if (d->dir == dir) {
+            hash_delete(&dentries, &d->elem);
+            d->dir = BOGUS_SECTOR;
+            list_remove(&d->lru_elem);
+            list_push_back(&lru, &d->lru_elem);
+        }
+    }
+    lock_release(&dentry_lock);
+}
+
+/*! Returns the generation counter of the directory in sector DIR. Must
+    be called with dentry_lock held. */
+static unsigned *generation(block_sector_t dir) {
+    return &generations[dir & (DENTRY_GENERATIONS - 1)];
+}
+
+/*! Returns the valid dentry for NAME in DIR, or NULL. Names too long to
+    be in a directory are never cached, lest they match a cached prefix.
+    Must be called with dentry_lock held. */
+static struct dentry *find(block_sector_t dir, const char *name) {
+    struct hash_elem *e;
+
+    if (strnlen(name, NAME_MAX + 1) > NAME_MAX)
+        return NULL;
+
+    probe.dir = dir;
+    strlcpy(probe.name, name, sizeof probe.name);
+    e = hash_find(&dentries, &probe.elem);
+    return e != NULL ? hash_entry(e, struct dentry, elem) : NULL;
+}
+
+/*! Makes NAME in DIR resolve to SECTOR, reusing the least recently used
+    entry if NAME isn't cached yet. Must be called with dentry_lock held. */
+static void set(block_sector_t dir, const char *name, block_sector_t sector) {
+    struct dentry *d = find(dir, name);
+
+    if (strnlen(name, NAME_MAX + 1) > NAME_MAX)
+        return;
+    if (d == NULL) {
+        d = list_entry(list_back(&lru), struct dentry, lru_elem);
+        if (d->dir != BOGUS_SECTOR)
+            hash_delete(&dentries, &d->elem);
+        d->dir = dir;
+        strlcpy(d->name, name, sizeof d->name);
+        hash_insert(&dentries, &d->elem);
+    }
+    d->sector = sector;
+    list_remove(&d->lru_elem);
+    list_push_front(&lru, &d->lru_elem);
+}
@@ -0,0 +1,24 @@
+#ifndef FILESYS_DENTRY_H
+#define FILESYS_DENTRY_H
+
+#include <stdbool.h>
+#include "devices/block.h"
+
+/*! Most (directory, name) pairs the dentry cache remembers. */
+#define DENTRY_CACHE_SIZE 128
+
+/*! Number of generation counters directories are spread over, by the
+    sector of their inode. Must be a power of two. */
+#define DENTRY_GENERATIONS 16
+
+void dentry_init(void);
+unsigned dentry_generation(block_sector_t dir);
+bool dentry_lookup(block_sector_t dir, const char *name,
+                   block_sector_t *sector);
+void dentry_fill(block_sector_t dir, const char *name, block_sector_t sector,
+                 unsigned generation);
+void dentry_update(block_sector_t dir, const char *name,
+                   block_sector_t sector);
+void dentry_forget_dir(block_sector_t dir);
+
+#endif /* filesys/dentry.h */
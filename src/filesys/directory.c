@@ -2,26 +2,67 @@
 #include <stdio.h>
 #include <string.h>
 #include <list.h>
+#include <hash.h>
+#include <round.h>
+#include "filesys/cache.h"
+#include "filesys/dentry.h"
 #include "filesys/filesys.h"
 #include "filesys/inode.h"
 #include "threads/malloc.h"
+#include "threads/synch.h"
 #include "threads/thread.h"
 
+// ------------------------------ Definitions ---------------------------------
+
+/*! Number of locks directory changes are spread over, by the sector of the
+    directory's inode. Must be a power of two. */
+#define DIR_LOCK_STRIPES 16
+
+/*! Directory entries in the level 0 bucket, few enough that a directory
+    with no more names than that stays inline in its inode sector. */
+#define DIR_LEVEL0_ENTRIES (INODE_INLINE_BYTES / sizeof(struct dir_entry))
+
+/*! Held from a change's lookup of its slot till the slot is written, so
+    two changes to one directory can't both take the same free slot, or
+    both find a name missing and add it twice. */
+static struct lock dir_locks[DIR_LOCK_STRIPES];
+
 // ------------------------------ Prototypes ----------------------------------
 
 static uint32_t get_last_consecutive_char(const char *str, char c);
 static bool is_single_repeated_char(const char *str, char c);
+static off_t bucket_offset(unsigned hash, int level);
+static size_t bucket_entries(int level);
+static bool lookup(const struct dir *dir, const char *name,
+		struct dir_entry *ep, off_t *ofsp, off_t *freep);
+static block_sector_t lookup_sector(struct inode *dir_inode, const char *name);
+static struct lock *dir_lock(const struct dir *dir);
 
 // -------------------------------- Bodies ------------------------------------
 
+/*! Initializes the directory module. */
+void dir_init(void) {
+    int i;
+
+    for (i = 0; i < DIR_LOCK_STRIPES; i++)
+        lock_init(&dir_locks[i]);
+}
+
+/*! Returns the lock changes to DIR are made under. */
+static struct lock *dir_lock(const struct dir *dir) {
+    return &dir_locks[dir->inode->sector & (DIR_LOCK_STRIPES - 1)];
+}
+
 /*! Creates a directory with space for ENTRY_CNT entries in the
     given SECTOR.  Returns true if successful, false on failure. */
 bool dir_create(block_sector_t sector, size_t entry_cnt,
 		const char *name, block_sector_t parent) {
 	ASSERT(entry_cnt > 0);
 
-	// TODO the 0 length needs to change after file extension is implemented
-	return inode_create(sector, 0, true, name, parent);
+	/* Zeroed entries aren't in use. Files extend, so this is just room to
+	   start with. */
+	return inode_create(sector, entry_cnt * sizeof(struct dir_entry), true,
+			name, parent);
 }
 
 /*! Opens and returns the directory for the given INODE, of which
@@ -66,6 +107,118 @@ struct inode * dir_get_inode(struct dir *dir) {
 }
 
 
+/*! Byte offset of the bucket a name hashing to HASH lands in at LEVEL.
+    Level L is the 2^L buckets after the 2^L - 1 of the levels before it. */
+static off_t bucket_offset(unsigned hash, int level) {
+    unsigned first = (1u << level) - 1;
+    return (off_t) (first + (hash & first)) * BLOCK_SECTOR_SIZE;
+}
+
+/*! Number of directory entries in a bucket at LEVEL. */
+static size_t bucket_entries(int level) {
+    return level == 0 ? DIR_LEVEL0_ENTRIES : DIR_BUCKET_ENTRIES;
+}
+
+/*! Searches DIR for a file with the given NAME.  If successful, returns
+    true, sets *EP to the directory entry if EP is non-null, and sets *OFSP
+    to the byte offset of the directory entry if OFSP is non-null.
+    Otherwise, returns false and ignores EP and OFSP. If FREEP is non-null,
+    sets *FREEP to the byte offset of the first free slot NAME could be
+    added at, or -1 if there's none.
+
+    NAME's hash picks one bucket per level, and the search walks them from
+    level 0 up. A name only goes up a level when its bucket below is full,
+    and slots never go back to being unused once a name has been in them,
+    so the first bucket with an unused slot ends the search. Buckets 
+    past the end of DIR, or in holes, read as all unused. */
+static bool lookup(const struct dir *dir, const char *name,
+		struct dir_entry *ep, off_t *ofsp, off_t *freep) {
+    unsigned hash = hash_string(name);
+    const struct dir_entry *bucket;
+    const uint8_t *bytes = NULL;
+    cache_sector_id src;
+    bool found = false;
+    bool exhausted = false;
+    int level;
+    size_t i, n;
+
+    ASSERT(dir != NULL);
+    ASSERT(name != NULL);
+
+    if (freep != NULL)
+        *freep = -1;
+    for (level = 0; level < DIR_LEVELS && !found && !exhausted; level++) {
+        off_t base = bucket_offset(hash, level);
+        size_t entries = bucket_entries(level);
+        off_t size = entries * sizeof *bucket;
+
+        /* Look at the bucket where it's cached, rather than copy it out. */
+        src = inode_crab_into_bytes(dir->inode, base, &size, &bytes);
+        n = src != NO_CACHE_SECTOR ? size / sizeof *bucket : 0;
+        bucket = (const struct dir_entry *) bytes;
+
+        for (i = 0; i < entries; i++) {
+            if (i < n && bucket[i].in_use) {
+                if (!strcmp(name, bucket[i].name)) {
+                    found = true;
+                    if (ep != NULL)
+                        *ep = bucket[i];
+                    if (ofsp != NULL)
+                        *ofsp = base + i * sizeof *bucket;
+                    break;
+                }
+                continue;
+            }
+            if (freep != NULL && *freep == -1)
+                *freep = base + i * sizeof *bucket;
+            if (i >= n || bucket[i].name[0] == '\0') {
+                exhausted = true;
+                break;
+            }
+        }
+
+        if (src != NO_CACHE_SECTOR)
+            crab_outof_cached_sector(src, true);
+    }
+
+    return found;
+}
+
+/*! Returns the sector of the inode NAME names in the directory DIR_INODE,
+    "." and ".." included, or BOGUS_SECTOR if there's no such entry. Reads
+    the directory without asking the dentry cache, then fills it in. */
+static block_sector_t lookup_sector_on_disk(struct inode *dir_inode,
+                                            const char *name) {
+	struct dir dir;
+	struct dir_entry e;
+	block_sector_t sector;
+	unsigned generation;
+
+	ASSERT(dir_inode->is_dir);
+
+	if (strcmp(name, ".") == 0)
+		return dir_inode->sector;
+	if (strcmp(name, "..") == 0)
+		return dir_inode->parent_dir;
+
+	generation = dentry_generation(dir_inode->sector);
+	dir.inode = dir_inode;
+	dir.pos = 0;
+	sector = lookup(&dir, name, &e, NULL, NULL) ? e.inode_sector 
+	                                             : BOGUS_SECTOR;
+	dentry_fill(dir_inode->sector, name, sector, generation);
+	return sector;
+}
+
+/*! As lookup_sector_on_disk, but goes to the dentry cache first. */
+static block_sector_t lookup_sector(struct inode *dir_inode, const char *name) {
+	block_sector_t sector;
+
+	if (dentry_lookup(dir_inode->sector, name, &sector))
+		return sector;
+	return lookup_sector_on_disk(dir_inode, name);
+}
+
 /*! Searches DIR for a file with the given NAME and returns true if one exists,
     false otherwise.  On success, sets *INODE to an inode for the file,
     otherwise to a null pointer.  The caller must close *INODE. */
@@ -73,7 +226,7 @@ bool dir_lookup(const struct dir *dir, const char *name, struct inode **inode) {
     ASSERT(dir != NULL);
     ASSERT(name != NULL);
     
-    block_sector_t sect = inode_find_matching_dir_entry(dir->inode, name);
+    block_sector_t sect = lookup_sector(dir->inode, name);
     if (sect == BOGUS_SECTOR) {        
     	*inode = NULL;
     	return false;
@@ -91,6 +244,8 @@ bool dir_lookup(const struct dir *dir, const char *name, struct inode **inode) {
     Fails if NAME is invalid (i.e. too long) or a disk or memory
     error occurs. */
 bool dir_add(struct dir *dir, const char *name, block_sector_t inode_sector) {
+    struct dir_entry e;
+    off_t ofs;
     bool success = false;
 
     ASSERT(dir != NULL);
@@ -100,24 +255,24 @@ bool dir_add(struct dir *dir, const char *name, block_sector_t inode_sector) {
     if (*name == '\0' || strlen(name) > NAME_MAX)
         return false;
 
-    /* Check that NAME is not in use. */
-    if(inode_find_matching_dir_entry(dir->inode, name) != BOGUS_SECTOR)
+    /* Check that NAME is not in use, and find where it would go. If
+       that's past end-of-file, the directory grows to take it. */
+    lock_acquire(dir_lock(dir));
+    if (lookup(dir, name, NULL, NULL, &ofs) || ofs == -1)
     	goto done;
 
-    /* If we got here then the NAME is valid and unused in this directory.
-       Add it to the directory by putting its sector into the directory's
-       entries array. */
-    int idx = inode_get_first_open_directory_slot(dir->inode);
-    if (idx == -1) {
-    	PANIC("Not enough room in the inode for a new directory entry.");
-    	NOT_REACHED();
+    /* Write slot. */
+    e.in_use = true;
+    strlcpy(e.name, name, sizeof e.name);
+    e.inode_sector = inode_sector;
+    success = inode_write_at(dir->inode, &e, sizeof e, ofs) == sizeof e;
+    if (success) {
+        inode_add_entries(dir->inode, 1);
+        dentry_update(dir->inode->sector, name, inode_sector);
     }
-    /* Add the given filename to the inode's sector in case it's not already
-       there. */
-    dir->inode->dir_contents[idx] = inode_sector;
-    success = true;
 
 done:
+    lock_release(dir_lock(dir));
     return success;
 }
 
@@ -130,26 +285,32 @@ bool dir_remove(struct dir *dir, const char *name) {
     ASSERT(dir != NULL && dir->inode != NULL);
     ASSERT(name != NULL);
 
-    /* Check that NAME is not in use. */
-    block_sector_t sect;
-    int idx;
-    inode_find_matching_idx_and_sector(dir->inode, name, &sect, &idx);
-	if(sect == BOGUS_SECTOR)
+    /* Find directory entry. */
+    struct dir_entry e;
+    off_t ofs;
+    lock_acquire(dir_lock(dir));
+    if (!lookup(dir, name, &e, &ofs, NULL))
 		goto done;
 
-	/* Erase the entry for the entries array of the directory's inode. */
-	if (idx != -1) {
-		dir->inode->dir_contents[idx] = BOGUS_SECTOR;
-	}
-
-	/* Open inode, remove it. */
-	inode = inode_open(sect);
+	/* Open inode. */
+	inode = inode_open(e.inode_sector);
 	if (inode == NULL)
 		goto done;
+
+	/* Erase directory entry. The name stays, marking the slot as one
+	   that's been used, see lookup(). */
+	e.in_use = false;
+	if (inode_write_at(dir->inode, &e, sizeof e, ofs) != sizeof e)
+		goto done;
+	inode_add_entries(dir->inode, -1);
+	dentry_update(dir->inode->sector, name, BOGUS_SECTOR);
+
+	/* Remove inode. */
 	inode_remove(inode);
 	success = true;
 
 done:
+    lock_release(dir_lock(dir));
     inode_close(inode);
     return success;
 }
@@ -157,25 +318,35 @@ done:
 /*! Reads the next directory entry in DIR and stores the name in NAME.  Returns
     true if successful, false if the directory contains no more entries. */
 bool dir_readdir(struct dir *dir, char name[NAME_MAX + 1]) {
-	bool success = false;
-
-    while (dir->pos < MAX_DIR_ENTRIES && dir->pos >=0) {
-    	if (dir->inode->dir_contents[dir->pos] == BOGUS_SECTOR) {
-    		dir->pos++;
-    		continue;
-    	}
-    	struct inode *entry_inode =
-    			inode_open(dir->inode->dir_contents[dir->pos]);
-    	if (entry_inode == NULL) {
-    		PANIC("Couldn't open entry's inode.");
-    		NOT_REACHED();
-    	}
-    	strlcpy(name, entry_inode->filename, NAME_MAX + 1);
-    	success = true;
+    struct dir_entry e;
+
+    for (;;) {
+        /* Buckets that were never written are holes, skip them whole
+           rather than read them as zeros an entry at a time. */
+        while (dir->pos % BLOCK_SECTOR_SIZE == 0 && !dir->inode->is_inline &&
+               dir->pos < inode_length(dir->inode) &&
+               inode_sector_at(dir->inode, dir->pos) == SILLY_OLD_DISK_SECTOR)
+            dir->pos += BLOCK_SECTOR_SIZE;
+
+        if (inode_read_at(dir->inode, &e, sizeof e, dir->pos) != sizeof e)
+            return false;
+        dir->pos += sizeof e;
+        /* Skip the slack at the end of each bucket, bucket 0 being all of
+           level 0. */
+        if (dir->pos % BLOCK_SECTOR_SIZE ==
+            (off_t) (bucket_entries(dir->pos < BLOCK_SECTOR_SIZE ? 0 : 1) *
+                     sizeof e))
+            dir->pos = ROUND_UP(dir->pos, BLOCK_SECTOR_SIZE);
+        if (e.in_use) {
+            strlcpy(name, e.name, NAME_MAX + 1);
+            return true;
+        }
     }
+}
 
-    dir->pos++;
-    return success;
+/*! Returns true if DIR has no entries in use. */
+bool dir_is_empty(const struct dir *dir) {
+    return inode_entry_count(dir->inode) == 0;
 }
 
 /*! Returns index of last consecutive char C in STR from its start.
@@ -234,8 +405,7 @@ struct inode *dir_get_inode_from_path(const char *path,
 		}
 
 		*parent = last_slash == path ? dir_open_root()->inode : tinode;
-		block_sector_t files_sect = inode_find_matching_dir_entry(
-				*parent, trim_path);
+		block_sector_t files_sect = lookup_sector(*parent, trim_path);
 
 		struct inode *rtn = NULL;
 		if (files_sect != BOGUS_SECTOR) {
@@ -264,11 +434,7 @@ struct inode *dir_get_inode_from_path(const char *path,
 		curr_dir_sector = thread_current()->cwd_sect;
 
 	/* Iterate over each directory in the path. */
-	struct inode *tmpinode = NULL;
 	while (path_ptr < last_slash) {
-		if (tmpinode != NULL)
-			inode_close(tmpinode);
-
 		/* Find the current directory name from the path. */
 		char curr_dir_name[NAME_MAX + 1];
 		char *first_slash = strchr(path_ptr, '/');
@@ -277,34 +443,29 @@ struct inode *dir_get_inode_from_path(const char *path,
 		first_slash += get_last_consecutive_char(first_slash, '/');
 		strlcpy(curr_dir_name, path_ptr, first_slash - path_ptr + 1);
 
-		/* Get the directory's sector from disk or the cache. */
-		tmpinode = inode_open(curr_dir_sector);
-		if (tmpinode == NULL) {
-			PANIC ("Couldn't alloc memory when opening inode.");
-			NOT_REACHED();
+		/* A component resolved recently is in the dentry cache, and we
+		   needn't so much as open the directory. Otherwise get the
+		   directory's sector from disk or the cache, and look it up
+		   there, having just missed in the dentry cache. */
+		block_sector_t next_sector;
+		if (!dentry_lookup(curr_dir_sector, curr_dir_name, &next_sector)) {
+			struct inode *tmpinode = inode_open(curr_dir_sector);
+			if (tmpinode == NULL) {
+				PANIC ("Couldn't alloc memory when opening inode.");
+				NOT_REACHED();
+			}
+			ASSERT(tmpinode->is_dir);
+			next_sector = lookup_sector_on_disk(tmpinode, curr_dir_name);
+			inode_close(tmpinode);
 		}
-		ASSERT(tmpinode->is_dir);
 
-		/* Iterate over the sectors in the directory's entries list, looking
-		   for one with a matching name. */
-		if (strcmp(curr_dir_name, "..") == 0) {
-			curr_dir_sector = tmpinode->parent_dir;
-		}
-		else if (strcmp(curr_dir_name, ".") == 0) {
-			// curr_dir_sector says the same.
-		}
-		else {
-			block_sector_t tmp_dir_sector =
-					inode_find_matching_dir_entry(tmpinode, curr_dir_name);
-
-			/* If we couldn't find the requested file then return NULL. */
-			if (tmp_dir_sector == BOGUS_SECTOR) {
-				*parent = NULL;
-				strlcpy(filename, "", 1);
-				return NULL;
-			}
-			curr_dir_sector = tmp_dir_sector;
+		/* If we couldn't find the requested file then return NULL. */
+		if (next_sector == BOGUS_SECTOR) {
+			*parent = NULL;
+			strlcpy(filename, "", 1);
+			return NULL;
 		}
+		curr_dir_sector = next_sector;
 		path_ptr = first_slash + 1;
 	}
 	/* Otherwise we need to get the inode by using the end of the path
@@ -314,13 +475,10 @@ struct inode *dir_get_inode_from_path(const char *path,
 	strlcpy(filename, name_at_end, NAME_MAX + 1);
 	*parent = inode_open(curr_dir_sector);
 
-	ASSERT(tmpinode != NULL);
-	ASSERT(tmpinode->is_dir);
 	block_sector_t fsect = BOGUS_SECTOR;
 	if (*parent != NULL)
-		fsect = inode_find_matching_dir_entry(*parent, name_at_end);
+		fsect = lookup_sector(*parent, name_at_end);
 
-	inode_close(tmpinode);
 	if (fsect == BOGUS_SECTOR)
 		return NULL;
 	struct inode *rtn = inode_open(fsect);
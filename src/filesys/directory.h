@@ -14,6 +14,15 @@
     retained, but much longer full path names must be allowed. */
 #define NAME_MAX 14
 
+/*! Directory entries in a bucket, one sector of a directory's data, past
+    level 0. The rest of the sector is slack. */
+#define DIR_BUCKET_ENTRIES (BLOCK_SECTOR_SIZE / sizeof(struct dir_entry))
+
+/*! Levels of buckets in a directory, see lookup() in directory.c. Level L
+    has 2^L buckets, so the 2^DIR_LEVELS - 1 of them must fit the largest
+    file an inode indexes. */
+#define DIR_LEVELS 14
+
 // ------------------------- Forward declarations -----------------------------
 
 struct inode;
@@ -36,6 +45,7 @@ struct dir_entry {
 // ------------------------------ Prototypes ----------------------------------
 
 /* Opening and closing directories. */
+void dir_init(void);
 bool dir_create(block_sector_t sector, size_t entry_cnt,
 		const char *name, block_sector_t parent);
 struct dir *dir_open(struct inode *);
@@ -49,6 +59,7 @@ bool dir_lookup(const struct dir *, const char *name, struct inode **);
 bool dir_add(struct dir *, const char *name, block_sector_t);
 bool dir_remove(struct dir *, const char *name);
 bool dir_readdir(struct dir *, char name[NAME_MAX + 1]);
+bool dir_is_empty(const struct dir *);
 struct inode *dir_get_inode_from_path(const char *path,
 		struct inode **parent, char *filename);
 
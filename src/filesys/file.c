@@ -13,6 +13,7 @@ struct file * file_open(struct inode *inode) {
         file->inode = inode;
         file->pos = 0;
         file->deny_write = false;
+        file->direct = false;
         return file;
     }
     else {
@@ -47,7 +48,7 @@ struct inode * file_get_inode(struct file *file) {
     than SIZE if end of file is reached.  Advances FILE's position by the
     number of bytes read. */
 off_t file_read(struct file *file, void *buffer, off_t size) {
-    off_t bytes_read = inode_read_at(file->inode, buffer, size, file->pos);
+    off_t bytes_read = file_read_at(file, buffer, size, file->pos);
     file->pos += bytes_read;
     return bytes_read;
 }
@@ -58,6 +59,8 @@ off_t file_read(struct file *file, void *buffer, off_t size) {
     unaffected. */
 off_t file_read_at(struct file *file, void *buffer, off_t size,
                    off_t file_ofs) {
+    if (file->direct)
+        return inode_read_at_direct(file->inode, buffer, size, file_ofs);
     return inode_read_at(file->inode, buffer, size, file_ofs);
 }
 
@@ -72,7 +75,7 @@ bool file_isdir (struct file *file){
     case, but file growth is not yet implemented.)
     Advances FILE's position by the number of bytes read. */
 off_t file_write(struct file *file, const void *buffer, off_t size) {
-    off_t bytes_written = inode_write_at(file->inode, buffer, size, file->pos);
+    off_t bytes_written = file_write_at(file, buffer, size, file->pos);
     file->pos += bytes_written;
     return bytes_written;
 }
@@ -84,9 +87,19 @@ off_t file_write(struct file *file, const void *buffer, off_t size) {
     The file's current position is unaffected. */
 off_t file_write_at(struct file *file, const void *buffer, off_t size,
                     off_t file_ofs) {
+    if (file->direct)
+        return inode_write_at_direct(file->inode, buffer, size, file_ofs);
     return inode_write_at(file->inode, buffer, size, file_ofs);
 }
 
+/*! Sets whether reads and writes of FILE move whole sectors straight 
+    between the caller's buffer and disk, rather than through the buffer
+    cache. Partial sectors still go through the cache. */
+void file_set_direct(struct file *file, bool direct) {
+    ASSERT(file != NULL);
+    file->direct = direct;
+}
+
 /*! Prevents write operations on FILE's underlying inode
     until file_allow_write() is called or FILE is closed. */
 void file_deny_write(struct file *file) {
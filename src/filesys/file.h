@@ -9,6 +9,7 @@ struct file {
     struct inode *inode;        /*!< File's inode. */
     off_t pos;                  /*!< Current position. */
     bool deny_write;            /*!< Has file_deny_write() been called? */
+    bool direct;                /*!< Bypass the buffer cache? */
 };
 
 struct inode;
@@ -26,6 +27,9 @@ off_t file_read_at (struct file *, void *, off_t size, off_t start);
 off_t file_write (struct file *, const void *, off_t);
 off_t file_write_at (struct file *, const void *, off_t size, off_t start);
 
+/* Bypassing the buffer cache. */
+void file_set_direct (struct file *, bool direct);
+
 /* Preventing writes. */
 void file_deny_write (struct file *);
 void file_allow_write (struct file *);
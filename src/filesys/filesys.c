@@ -1,14 +1,19 @@
 #include <debug.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <round.h>
 #include "filesys/file.h"
 #include "filesys/free-map.h"
 #include "filesys/inode.h"
 #include "filesys/directory.h"
 #include "filesys/cache.h"
+#include "filesys/dentry.h"
 #include "filesys/filesys.h"
 #include "threads/thread.h"
 #include "threads/malloc.h"
+#include "threads/synch.h"
+#include "lib/kernel/bitmap.h"
 #include "lib/user/syscall.h"
 #include "threads/thread.h"
 
@@ -17,13 +22,31 @@
 extern bool timer_initd;		   /*!< Extern'd from thread.c. */
 
 long long total_ticks;             /*!< Crude timer's tick count. */
-struct lock monitor_ra;			   /*!< Used to wake up read-ahead. */
-struct condition cond_ra;          /*!< Used to wake up read-ahead. */
+struct lock monitor_ra;			   /*!< Serializes read-ahead producers. */
+struct semaphore ra_wakeup;        /*!< Used to wake up read-ahead. */
 struct semaphore crude_time;       /*!< Downed here, upped in thread_tick */
+static bool write_behind_woken;    /*!< crude_time upped early, not yet down */
 struct block *fs_device;		   /*!< Partition that contains file system. */
 
-/*! List of the sectors N whose next elements N + 1 should be read ahead. */
-struct list ra_sectors;
+/*! Ring of the ra_requests the read-ahead thread has yet to get to, from
+    ra_head up to ra_tail (both free running, taken mod RA_RING_SIZE). 
+
+    Producers fill in ra_ring[ra_tail] and then advance ra_tail, holding 
+    monitor_ra so they don't trip over each other. The read-ahead thread is
+    the only consumer, and takes requests and advances ra_head without any
+    lock. A full ring drops new requests. */
+static struct ra_request ra_ring[RA_RING_SIZE];
+static volatile uint32_t ra_head, ra_tail;
+
+/*! Hashes of the (inode, sector) of every request in ra_ring, so producers
+    don't queue a sector twice. Set by producers, cleared by the consumer. A
+    hash collision just drops a request. */
+static struct bitmap *ra_queued_set;
+
+/*! Most sectors we read ahead of a sequential reader, and the largest 
+    window any reader has actually had. */
+static unsigned ra_window_cap = DEFAULT_READ_AHEAD_WINDOW;
+static unsigned ra_window_peak;
 
 // ------------------------------ Prototypes ----------------------------------
 
@@ -41,14 +64,20 @@ void filesys_init(bool format) {
         PANIC("No file system device found, can't initialize file system.");
 
     inode_init();
+    dir_init();
+    dentry_init();
     file_cache_init(); 
     free_map_init();    
 
     // Initialize the read-ahead and write-behind helper threads.
-    list_init(&ra_sectors);
+    ra_head = ra_tail = 0;
+    ra_queued_set = bitmap_create(RA_DEDUP_BITS);
+    if (ra_queued_set == NULL)
+        PANIC("Couldn't allocate read-ahead dedup set.");
     lock_init(&monitor_ra);
-    cond_init(&cond_ra);
+    sema_init(&ra_wakeup, 0);
     sema_init(&crude_time, 0);
+    write_behind_woken = false;
     total_ticks = 0;
 
     thread_create("write-behind", PRI_DEFAULT, write_behind_func, NULL, 1,
@@ -67,8 +96,8 @@ void filesys_init(bool format) {
 
 /*! Shuts down the file system module, writing any unwritten data to disk. */
 void filesys_done(void) {
-	flush_cache_to_disk();
     free_map_close();
+	flush_cache_to_disk();
 }
 
 /*! Gets length oftrailing filename in the given absolute or relative path. */
@@ -110,6 +139,9 @@ bool filesys_create(const char *path, off_t initial_size,
     bool success = false;
     
     if(dir_static.inode != NULL && free_map_allocate(1, &inode_sector)) {
+    	/* The sector may have held a directory that's since been removed. */
+    	if (is_directory)
+    		dentry_forget_dir(inode_sector);
     	bool in_success = inode_create(inode_sector,
     			initial_size, is_directory, filename,
 				is_directory ? parent : BOGUS_SECTOR)
@@ -192,40 +224,152 @@ static void do_format(void) {
     printf("done.\n");
 }
 
-/*! Iterate over all the cache entries periodically, writing the dirty ones
-    back to disk to protect against a system crash. The timing is done with
-    a condition variable that is signalling from thread_tick. */
+/*! Periodically writes back to disk the cache sectors that have been dirty
+    too long, to protect against a system crash, and whatever it takes to 
+    get the cache under its dirty watermarks. The timing is done with a 
+    semaphore upped from thread_tick, or early by 
+    filesys_wake_write_behind. */
 void write_behind_func(void *aux UNUSED) {
 	do {
 		sema_down(&crude_time); // Wait.
-		flush_cache_to_disk();
+		write_behind_woken = false;
+		free_map_flush();
+		cache_write_behind();
 	} while (true);
 }
 
-/*! Whenever a sector is read in from disk, the next one to read is queued up
-    in ra_sectors and this thread is woken up. This thread is responsible for
-    reading in that sector in the background. */
-void read_ahead_func(void *aux UNUSED) {
-	do {
-		lock_acquire(&monitor_ra);
-		while(list_size(&ra_sectors) == 0) {
-			cond_wait(&cond_ra, &monitor_ra);
-		}
+/*! Wakes the write-behind thread without waiting for the next tick, if it
+    hasn't been already. */
+void filesys_wake_write_behind(void) {
+	if (!write_behind_woken) {
+		write_behind_woken = true;
+		sema_up(&crude_time);
+	}
+}
+
+/*! Parses the -fs-ra-window=N kernel option, the most sectors we'll read
+    ahead of a sequential reader. 0 turns read-ahead off. */
+void filesys_configure_read_ahead(const char *window) {
+	if (window == NULL || atoi(window) < 0)
+		PANIC("-fs-ra-window needs a sector count");
+	ra_window_cap = atoi(window);
+}
 
-		struct list_elem *l = list_pop_front(&ra_sectors);
-		struct ra_sect_elem *rasect =
-				list_entry(l, struct ra_sect_elem, ra_elem);
+/*! Returns the bit for byte OFFSET of INODE in ra_queued_set. */
+static size_t ra_hash(struct inode *inode, off_t offset) {
+	return (inode_get_inumber(inode) * 31 + offset / BLOCK_SECTOR_SIZE) &
+			(RA_DEDUP_BITS - 1);
+}
 
-		// Read in the next sector from disk.
-		lock_release(&monitor_ra);
-		crab_outof_cached_sector(
-				crab_into_cached_sector(rasect->sect_n, true, false), true);
-		lock_acquire(&monitor_ra);
+/*! Called after every read of BYTES bytes at OFFSET from INODE, which is
+    LENGTH bytes long, to keep the read-ahead window for INODE going. 
+
+    A read starting where the last one left off is sequential, and doubles
+    the window, up to ra_window_cap sectors. Anything else is random, and
+    shuts the window. The sectors in the window past what was just read, and
+    not already queued, are queued up for the read-ahead thread, unless the
+    ring is full. */
+void filesys_read_ahead(struct inode *inode, off_t offset, off_t bytes,
+		off_t length) {
+	struct ra_request *req;
+	off_t pos, end;
+	bool was_empty;
+
+	lock_acquire(&monitor_ra);
+
+	if (bytes > 0 && offset == inode->ra_next) {
+		inode->ra_window = inode->ra_window == 0 ? 1 : 2 * inode->ra_window;
+		if (inode->ra_window > ra_window_cap)
+			inode->ra_window = ra_window_cap;
+	} else {
+		inode->ra_window = 0;
+		inode->ra_queued = 0;
+	}
+	inode->ra_next = offset + bytes;
+	if (inode->ra_window > ra_window_peak)
+		ra_window_peak = inode->ra_window;
+
+	pos = ROUND_UP(offset + bytes, BLOCK_SECTOR_SIZE);
+	end = pos + (off_t) inode->ra_window * BLOCK_SECTOR_SIZE;
+	if (end > length)
+		end = length;
+	if (pos < inode->ra_queued)
+		pos = inode->ra_queued;
+
+	was_empty = ra_tail == ra_head;
+	for (; pos < end; pos += BLOCK_SECTOR_SIZE) {
+		if (ra_tail - ra_head >= RA_RING_SIZE)
+			break;
+		inode->ra_queued = pos + BLOCK_SECTOR_SIZE;
+		if (bitmap_test(ra_queued_set, ra_hash(inode, pos)))
+			continue;
+
+		bitmap_mark(ra_queued_set, ra_hash(inode, pos));
+		req = &ra_ring[ra_tail & (RA_RING_SIZE - 1)];
+		req->inode = inode_reopen(inode);
+		req->offset = pos;
+		/* Publish the request only once it's filled in. */
+		barrier();
+		ra_tail++;
+	}
 
-		list_remove(l);
-		free(rasect);
+	/* The read-ahead thread only sleeps on an empty ring. */
+	if (was_empty && ra_tail != ra_head)
+		sema_up(&ra_wakeup);
+	lock_release(&monitor_ra);
+}
 
-		lock_release(&monitor_ra);
+/*! Prints read-ahead statistics. */
+void filesys_print_stats(void) {
+	printf("Read-ahead: window cap %u sectors, largest window %u sectors\n",
+			ra_window_cap, ra_window_peak);
+}
+
+/*! Whenever a file is read sequentially, the sectors after the ones read
+    are queued up in ra_ring as (inode, offset)s and this thread is woken
+    up. This thread is responsible for finding those sectors through the
+    inodes' indices, so read-ahead follows the file rather than the disk, and
+    reading them in the background. It drains everything queued so far in
+    one go before checking for more, and sectors that turn out to be
+    contiguous on disk are read in with one request. */
+void read_ahead_func(void *aux UNUSED) {
+	struct ra_request req;
+	block_sector_t sector;
+	block_sector_t run_start = 0;
+	size_t run_len;
+	uint32_t batch_end;
+
+	do {
+		while (ra_head == ra_tail)
+			sema_down(&ra_wakeup);
+
+		run_len = 0;
+		batch_end = ra_tail;
+		barrier();
+		while (ra_head != batch_end) {
+			req = ra_ring[ra_head & (RA_RING_SIZE - 1)];
+			bitmap_reset(ra_queued_set, ra_hash(req.inode, req.offset));
+			barrier();
+			ra_head++;
+
+			// Find the sector on disk, if the file still has it.
+			sector = inode_sector_at(req.inode, req.offset);
+			inode_close(req.inode);
+			if (sector == SILLY_OLD_DISK_SECTOR)
+				continue;
+
+			if (run_len > 0 && run_len < CACHE_MAX_RUN &&
+				sector == run_start + run_len) {
+				run_len++;
+				continue;
+			}
+			if (run_len > 0)
+				cache_prefetch(run_start, run_len);
+			run_start = sector;
+			run_len = 1;
+		}
+		if (run_len > 0)
+			cache_prefetch(run_start, run_len);
 	} while (true);
 }
 
@@ -15,16 +15,30 @@
 
 #define BOGUS_SECTOR 0xFFFFFFFF  /*!< Non-present sector. */
 
+/*! Default cap, in sectors, on how far ahead of a sequential reader we read.
+    The -fs-ra-window kernel option overrides it at boot. */
+#define DEFAULT_READ_AHEAD_WINDOW 8
+
+/*! Capacity of the read-ahead request ring. Must be a power of two. */
+#define RA_RING_SIZE 64
+
+/*! Bits in the hashed set of queued read-ahead requests. Must be a power of
+    two. */
+#define RA_DEDUP_BITS 1024
+
 // ---------------------------- Global variables ------------------------------
 
 struct block *fs_device; 		 /*! Block device that contains file system. */
 
 // ------------------------------ Structures ----------------------------------
 
-/*! Each element in a list of sectors to read-ahead. */
-struct ra_sect_elem {
-	block_sector_t sect_n;
-	struct list_elem ra_elem;
+struct inode;
+
+/*! A request to read ahead the sector holding byte OFFSET of INODE. Holds
+    a reference to INODE, so it can't be freed before the request is done. */
+struct ra_request {
+	struct inode *inode;
+	off_t offset;
 };
 
 // ------------------------------ Prototypes ----------------------------------
@@ -34,6 +48,11 @@ void filesys_done(void);
 struct file *filesys_open(const char *path);
 bool filesys_remove(const char *name);
 char *find_last_slash(const char *path);
+void filesys_configure_read_ahead(const char *window);
+void filesys_read_ahead(struct inode *inode, off_t offset, off_t bytes,
+		off_t length);
+void filesys_print_stats(void);
+void filesys_wake_write_behind(void);
 bool filesys_create(const char *path, off_t initial_size,
 		bool is_directory, block_sector_t parent);
 
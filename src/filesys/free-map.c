@@ -1,8 +1,11 @@
 #include "filesys/free-map.h"
 #include <bitmap.h>
 #include <debug.h>
+#include <round.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <string.h>
+#include "filesys/cache.h"
 #include "filesys/file.h"
 #include "filesys/filesys.h"
 #include "filesys/inode.h"
@@ -12,6 +15,20 @@ static struct file *free_map_file;   /*!< Free map file. */
 static struct bitmap *free_map;      /*!< Free map, one bit per sector. */
 static struct lock free_map_lock;    /*!< Free map lock. */
 
+/*! Sectors of free_map_file that are behind free_map, one bit each. They're
+    written out by free_map_flush, from the write-behind thread, rather than
+    the whole map on every allocation and release. Protected by
+    free_map_lock. */
+static struct bitmap *free_map_dirty;
+
+/*! Bits of the free map in one sector of free_map_file. */
+#define FREE_MAP_BITS_PER_SECTOR (BLOCK_SECTOR_SIZE * 8)
+
+static block_sector_t allocate_run(block_sector_t hint, size_t cnt);
+static void mark_dirty(block_sector_t sector, size_t cnt);
+static void write_in_place(struct inode *inode, const void *buffer,
+                           size_t size, off_t offset);
+
 /*! Initializes the free map. */
 void free_map_init(void) {
     lock_init(&free_map_lock);    
@@ -20,33 +37,65 @@ void free_map_init(void) {
         PANIC("bitmap creation failed--file system device is too large");
     bitmap_mark(free_map, FREE_MAP_SECTOR);
     bitmap_mark(free_map, ROOT_DIR_SECTOR);
+    free_map_dirty = bitmap_create(DIV_ROUND_UP(bitmap_file_size(free_map), 
+                                                BLOCK_SECTOR_SIZE));
+    if (free_map_dirty == NULL)
+        PANIC("bitmap creation failed--file system device is too large");
 }
 
 /*! Allocates CNT consecutive sectors from the free map and stores the first
     into *SECTORP.
 
     Returns true if successful, false if not enough consecutive sectors were
-    available or if the free_map file could not be written. */
+    available. */
 bool free_map_allocate(size_t cnt, block_sector_t *sectorp) {
-    
-    /* Require this for simpler file extension */
-    ASSERT(cnt == 1);
-
     lock_acquire(&free_map_lock);    
-    block_sector_t sector = bitmap_scan_and_flip(free_map, 0, cnt, false);
-    
-    if (sector != BITMAP_ERROR && free_map_file != NULL &&
-        !bitmap_write(free_map, free_map_file)) {
+    block_sector_t sector = allocate_run(0, cnt);
+    if (sector != BITMAP_ERROR) {
+        *sectorp = sector;        
+    }
+    lock_release(&free_map_lock);
 
-        // ==TODO== Move bitmap writes on the free-map to write-behind         
-        sector = BITMAP_ERROR;
+    return sector != BITMAP_ERROR;
+}
+
+/*! Allocates up to CNT consecutive sectors from the free map, the first 
+    free run at or after HINT if there is one, so a growing file can carry
+    on where it left off. Settles for half as many, and so on, if there's no
+    run of CNT free sectors anywhere. Stores the first into *SECTORP.
+
+    Returns how many sectors were allocated, 0 if the disk is full. */
+size_t free_map_allocate_run(block_sector_t hint, size_t cnt, 
+                             block_sector_t *sectorp) {
+    block_sector_t sector = BITMAP_ERROR;
+
+    lock_acquire(&free_map_lock);    
+    for (; cnt > 0; cnt /= 2) {
+        sector = allocate_run(hint, cnt);
+        if (sector != BITMAP_ERROR)
+            break;
     }
     if (sector != BITMAP_ERROR) {
         *sectorp = sector;        
     }
     lock_release(&free_map_lock);
 
-    return sector != BITMAP_ERROR;
+    return sector != BITMAP_ERROR ? cnt : 0;
+}
+
+/*! Allocates CNT consecutive sectors, the first such run at or after HINT, 
+    or failing that the first anywhere. Returns the first, or BITMAP_ERROR
+    if there is no such run. Must be called with free_map_lock held. */
+static block_sector_t allocate_run(block_sector_t hint, size_t cnt) {
+    block_sector_t sector = BITMAP_ERROR;
+
+    if (hint < bitmap_size(free_map))
+        sector = bitmap_scan_and_flip(free_map, hint, cnt, false);
+    if (sector == BITMAP_ERROR && hint != 0)
+        sector = bitmap_scan_and_flip(free_map, 0, cnt, false);
+    if (sector != BITMAP_ERROR)
+        mark_dirty(sector, cnt);
+    return sector;
 }
 
 /*! Makes CNT sectors starting at SECTOR available for use. */
@@ -54,11 +103,75 @@ void free_map_release(block_sector_t sector, size_t cnt) {
     lock_acquire(&free_map_lock);
     ASSERT(bitmap_all(free_map, sector, cnt));
     bitmap_set_multiple(free_map, sector, cnt, false);
-    bitmap_write(free_map, free_map_file); //==TODO== Currently assumed to work    
-    
+    mark_dirty(sector, cnt);
     lock_release(&free_map_lock);    
 }
 
+/*! Notes that the sectors of free_map_file holding the bits for the CNT
+    sectors starting at SECTOR need writing out. Must be called with 
+    free_map_lock held. */
+static void mark_dirty(block_sector_t sector, size_t cnt) {
+    size_t first = sector / FREE_MAP_BITS_PER_SECTOR;
+    size_t last = (sector + cnt - 1) / FREE_MAP_BITS_PER_SECTOR;
+
+    bitmap_set_multiple(free_map_dirty, first, last - first + 1, true);
+}
+
+/*! Writes the sectors of the free map that changed since they were last
+    written into the cache, for write-behind to take to disk. Does nothing
+    until the free map file is open.
+
+    This is called from the write-behind thread, so it goes straight to the
+    cached sectors of free_map_file rather than through file_write_at, which
+    may wait in cache_throttle_writer for a write-behind pass. That would 
+    never come, and everyone allocating would be stuck on free_map_lock.
+    The free map file is fully allocated when it's created, so its sectors
+    are all there to be written. */
+void free_map_flush(void) {
+    /* Only used with free_map_lock held. */
+    static uint8_t buffer[BLOCK_SECTOR_SIZE];
+    struct inode *inode;
+    size_t i, bytes;
+
+    lock_acquire(&free_map_lock);
+    if (free_map_file != NULL) {
+        inode = file_get_inode(free_map_file);
+        for (i = 0; i < bitmap_size(free_map_dirty); i++) {
+            if (!bitmap_test(free_map_dirty, i))
+                continue;
+            bytes = bitmap_copy_bytes(free_map, i * BLOCK_SECTOR_SIZE,
+                                      BLOCK_SECTOR_SIZE, buffer);
+            write_in_place(inode, buffer, bytes, i * BLOCK_SECTOR_SIZE);
+            bitmap_reset(free_map_dirty, i);
+        }
+    }
+    lock_release(&free_map_lock);
+}
+
+/*! Writes SIZE bytes from BUFFER at OFFSET of the free map file INODE,
+    within one sector, straight into the cache. Must be called with 
+    free_map_lock held. */
+static void write_in_place(struct inode *inode, const void *buffer,
+                           size_t size, off_t offset) {
+    cache_sector_id c;
+
+    if (size == 0)
+        return;
+    if (inode->is_inline) {
+        /* A small disk's free map lives in its inode sector. */
+        c = crab_into_cached_sector_of_class(inode->sector, false, false,
+                                             CACHE_CLASS_INODE);
+        cache_write(c, (void *) buffer, 
+                    offsetof(struct inode_disk, inline_data) + offset, size);
+    } else {
+        block_sector_t sector = inode_sector_at(inode, offset);
+        ASSERT(sector != SILLY_OLD_DISK_SECTOR);
+        c = crab_into_cached_sector(sector, false, false);
+        cache_write(c, (void *) buffer, offset % BLOCK_SECTOR_SIZE, size);
+    }
+    crab_outof_cached_sector(c, false);
+}
+
 /*! Opens the free map file and reads it from disk. */
 void free_map_open(void) {
     lock_acquire(&free_map_lock);
@@ -67,12 +180,17 @@ void free_map_open(void) {
         PANIC("can't open free map");
     if (!bitmap_read(free_map, free_map_file))
         PANIC("can't read free map");
+    bitmap_set_all(free_map_dirty, false);
     lock_release(&free_map_lock);
 }
 
 /*! Writes the free map to disk and closes the free map file. */
 void free_map_close(void) {
+    free_map_flush();
+    lock_acquire(&free_map_lock);
     file_close(free_map_file);
+    free_map_file = NULL;
+    lock_release(&free_map_lock);
 }
 
 /*! Creates a new free map file on disk and writes the free map to it. */
@@ -85,13 +203,12 @@ void free_map_create(void) {
     }
 
     /* Write bitmap to file. */
+    lock_acquire(&free_map_lock);
     free_map_file = file_open(inode_open(FREE_MAP_SECTOR));
     if (free_map_file == NULL)
         PANIC("can't open free map");
-
-    lock_acquire(&free_map_lock);
-    if (!bitmap_write(free_map, free_map_file))
-        PANIC("can't write free map");
+    bitmap_set_all(free_map_dirty, true);
     lock_release(&free_map_lock);    
+    free_map_flush();
 }
 
@@ -2,6 +2,7 @@
 #include <list.h>
 #include <debug.h>
 #include <round.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <string.h>
 #include <stdio.h>
@@ -16,455 +17,553 @@
 /*! Identifies an inode. */
 #define INODE_MAGIC 0x494e4f44
 
-static void get_indirection_indices(uint32_t *base_first_index, 
-                                    uint32_t *base_second_index, 
-                                    uint32_t *final_first_index, 
-                                    uint32_t *final_second_index, 
-                                    off_t current_length, 
-                                    off_t final_length);
-
-static bool inode_extend(   bool create_double_indirection, 
-                            block_sector_t* doubly_indirect_, 
-                            off_t current_length, 
-                            off_t *future_length,
-                            bool failure_acceptable);
-
-static void inode_set_length(const struct inode *inode, off_t updated_length);
-
-static void cleanup_failed_extension(  uint32_t base_first_index, 
-                                uint32_t base_second_index, 
-                                block_sector_t* doubly_indirect_,
-                                bool cleanup_double_indirection_on_error,
-                                bool cleanup_first_single_indirection_on_error,
-                                bool cleanup_first_data_sector_on_error);
+static bool inode_extend(block_sector_t inode_sector, off_t current_length,
+                         off_t start, off_t *future_length, 
+                         bool failure_acceptable, bool direct);
+static block_sector_t index_lookup(block_sector_t inode_sector, 
+                                   uint32_t block);
+static void index_release(block_sector_t inode_sector, uint32_t first);
+static void inode_set_length(struct inode *inode, off_t updated_length);
 
 void inode_tree_destroy(block_sector_t inode_sector);
 
-static void synch_directory_inode_to_disk (struct inode *i);
+static void inode_pin_index(struct inode *inode);
+static void inode_map_clear(struct inode *inode);
+static void inode_map_forget(block_sector_t inode_sector, uint32_t first);
+
+static off_t inode_read(struct inode *inode, void *buffer_, off_t size, 
+                        off_t offset, bool direct);
+static off_t inode_write(struct inode *inode, const void *buffer_, 
+                         off_t size, off_t offset, bool direct);
+static size_t direct_run_length(struct inode *inode, block_sector_t sector,
+                                off_t offset, off_t size, off_t length,
+                                bool extending);
+static off_t inode_read_inline(struct inode *inode, void *buffer, 
+                               off_t size, off_t offset);
+static off_t inode_write_inline(struct inode *inode, const void *buffer,
+                                off_t size, off_t offset);
+static bool inode_move_inline(struct inode *inode);
 
 /*! Returns the block device sector that contains byte offset POS
     within INODE.
     Returns SILLY_OLD_DISK_SECTOR if INODE does not contain data for a byte at 
-    offset POS. Ignores length restrictions if you are currently extending
-    and are trying to hide this fact from readers by not changing the
-    length. */
-static block_sector_t byte_to_sector(   const struct inode *inode, 
+    offset POS, being past its end, or in a hole nobody has written. Ignores
+    length restrictions if you are currently extending and are trying to
+    hide this fact from readers by not changing the length. */
+static block_sector_t byte_to_sector(   struct inode *inode, 
                                         off_t pos,
                                         bool extending) {
     ASSERT(inode != NULL);
 
-    /* First things first, check the file length against the position. It 
+    /* First things first, check the file length against the position. It
     doesn't matter if there IS room to write in the last sector, length
     is a hard stop. THEN, oh boy, then, if there's no length problem,
-    well, you're guaranteed to be able to access the sector without issue
-    because we don't have file length reduction. So then, you get
-    the indirection indices, and walk through the indirection reference
-    blocks, get the data sector in question, and return it's index! Hoorah! 
-    Also if there's a problem with length, then we'll try to extend outside
-    this call, get an extension lock, etc. So no synchronization on that part
-    is necessary.
+    well, you're guaranteed to be able to access the sector without issue,
+    if it's ever been written, because we don't have file length reduction.
+    So then, you walk the index down from the inode, through as many
+    indirection blocks as it takes, none for the first few blocks, get the
+    data sector in question, and return it's index! Hoorah! Also if there's
+    a problem with length, then we'll try to extend outside this call, get
+    an extension lock, etc. So no synchronization on that part is necessary.
     */
 
     if ((pos >= inode_length(inode)) && !extending) {
         return SILLY_OLD_DISK_SECTOR;
     }
 
-    block_sector_t result; 
-    cache_sector_id src;
-    struct inode_disk *data;
-    struct indirection_block *reference;
-    uint32_t first, second;     
-    
-    get_indirection_indices(&first, &second, &first, &second, pos+1, pos+1);
-    
-    src = crab_into_cached_sector(inode->sector, true, false); 
-    data = (struct inode_disk *) get_cache_sector_base_addr(src);            
-    result = data->doubly_indirect;   
-    
-    crab_outof_cached_sector(src, true);        
-    ASSERT(result != SILLY_OLD_DISK_SECTOR);
+    /* Inline data isn't in a data sector at all. */
+    if (inode->is_inline)
+        return SILLY_OLD_DISK_SECTOR;
 
+    block_sector_t result; 
+    uint32_t block = pos / BLOCK_SECTOR_SIZE;
+    size_t slot = block & (INODE_MAP_SLOTS - 1);
 
-    src = crab_into_cached_sector(result, true, false); 
-    reference = (struct indirection_block *) get_cache_sector_base_addr(src);            
-    result = reference->sector[first];
+    /* Looked this one up lately? */
+    lock_acquire(&inode->ismd_lock);
+    result = inode->map != NULL && inode->map[slot].block == block ? 
+             inode->map[slot].sector : SILLY_OLD_DISK_SECTOR;
+    lock_release(&inode->ismd_lock);
+    if (result != SILLY_OLD_DISK_SECTOR)
+        return result;
     
-    crab_outof_cached_sector(src, true);        
-    ASSERT(result != SILLY_OLD_DISK_SECTOR);
+    /* Holes have no sector till they're written, so aren't remembered. */
+    result = index_lookup(inode->sector, block);
+    if (result == SILLY_OLD_DISK_SECTOR)
+        return result;
 
-    src = crab_into_cached_sector(result, true, false); 
-    reference = (struct indirection_block *) get_cache_sector_base_addr(src);            
-    result = reference->sector[second];
-    
-    crab_outof_cached_sector(src, true);        
-    ASSERT(result != SILLY_OLD_DISK_SECTOR);
+    /* The map only gets allocated now we know it'll be used. If we can't
+       have it, we just don't remember. */
+    lock_acquire(&inode->ismd_lock);
+    if (inode->map == NULL) {
+        inode->map = malloc(INODE_MAP_SLOTS * sizeof *inode->map);
+        if (inode->map != NULL) {
+            size_t i;
+            for (i = 0; i < INODE_MAP_SLOTS; i++)
+                inode->map[i].block = INODE_MAP_EMPTY;
+        }
+    }
+    if (inode->map != NULL) {
+        inode->map[slot].block = block;
+        inode->map[slot].sector = result;
+    }
+    lock_release(&inode->ismd_lock);
 
     return result;
 }
 
-/*! List of open inodes, so that opening a single inode twice
-    returns the same `struct inode'. */
-static struct list open_inodes;
-static struct lock open_inodes_lock;
+/*! Forgets every byte_to_sector result INODE remembers. */
+static void inode_map_clear(struct inode *inode) {
+    lock_acquire(&inode->ismd_lock);
+    free(inode->map);
+    inode->map = NULL;
+    lock_release(&inode->ismd_lock);
+}
+
+/*! Number of independently locked parts of the open inode table. Must be
+    a power of two. */
+#define OPEN_INODE_STRIPES 16
+
+/*! Table of open inodes, so that opening a single inode twice returns the
+    same `struct inode'. Hashed on sector, and split by sector into 
+    stripes with a lock each, so opens of different inodes don't wait on
+    one another. An inode goes in the table still loading, and the lock is
+    let go while it's read from disk, so opens don't wait on an open that 
+    has to go to disk either, unless it's of the same inode, in which case
+    they wait on LOADED. */
+static struct open_inode_stripe {
+    struct lock lock;
+    struct hash inodes;
+    struct condition loaded;            /*!< An inode here is done loading. */
+    /*! Search key for hash_find, only touched with the lock held, so we
+        needn't put a whole struct inode on the stack to look one up. */
+    struct inode probe;
+} open_inodes[OPEN_INODE_STRIPES];
+
+/*! Returns the stripe of the open inode table for SECTOR. */
+static struct open_inode_stripe *open_inodes_stripe(block_sector_t sector) {
+    return &open_inodes[sector & (OPEN_INODE_STRIPES - 1)];
+}
+
+/*! Hashes an open inode on its sector. */
+static unsigned open_inode_hash(const struct hash_elem *e, void *aux UNUSED) {
+    return hash_int((int) hash_entry(e, struct inode, elem)->sector);
+}
+
+/*! Orders open inodes by sector. */
+static bool open_inode_less(const struct hash_elem *a, 
+                            const struct hash_elem *b, void *aux UNUSED) {
+    return hash_entry(a, struct inode, elem)->sector < 
+           hash_entry(b, struct inode, elem)->sector;
+}
+
+/*! Makes the open inode in INODE_SECTOR, if there is one, forget what it
+    remembers of blocks FIRST on, whose sectors have just been released. */
+static void inode_map_forget(block_sector_t inode_sector, uint32_t first) {
+    struct open_inode_stripe *stripe = open_inodes_stripe(inode_sector);
+    struct hash_elem *e;
+    size_t i;
+
+    lock_acquire(&stripe->lock);
+    stripe->probe.sector = inode_sector;
+    e = hash_find(&stripe->inodes, &stripe->probe.elem);
+    if (e != NULL) {
+        struct inode *inode = hash_entry(e, struct inode, elem);
+
+        lock_acquire(&inode->ismd_lock);
+        for (i = 0; inode->map != NULL && i < INODE_MAP_SLOTS; i++) {
+            if (inode->map[i].block != INODE_MAP_EMPTY &&
+                inode->map[i].block >= first)
+                inode->map[i].block = INODE_MAP_EMPTY;
+        }
+        lock_release(&inode->ismd_lock);
+    }
+    lock_release(&stripe->lock);
+}
 
 /*! Initializes the inode module. */
 void inode_init(void) {
-    list_init(&open_inodes);
-    lock_init(&open_inodes_lock);
+    int i;
+
+    for (i = 0; i < OPEN_INODE_STRIPES; i++) {
+        lock_init(&open_inodes[i].lock);
+        cond_init(&open_inodes[i].loaded);
+        if (!hash_init(&open_inodes[i].inodes, open_inode_hash, 
+                       open_inode_less, NULL))
+            PANIC("Couldn't allocate the open inode table.");
+    }
 }
 
-/*! Takes a current length (0) and a final length (length) and 
-
-    Returns (base_first_index >= 0, base_second_index >= 0)
-    Returns (final_first_index >= 0, final_second_index >= 0)
-
-    As the base and final double/single indirection references we must start
-    allocating at, and end up at, allocated and referenced to new data sectors, 
-    to meet the length requirement. (0,0,1,2) would mean start at the beginning, and 
-    fill the entire 0th double indirection referenced sector with 
-    single indirection references to data sectors, and fill the 0th,1st,2nd 
-    data sector references out the second double indirection referenced
-    sector. */
-static void 
-get_indirection_indices(    uint32_t *base_first_index, 
-                            uint32_t *base_second_index, 
-                            uint32_t *final_first_index, 
-                            uint32_t *final_second_index, 
-                            off_t current_length, 
-                            off_t final_length) {
-    
-    ASSERT(current_length <= final_length);
-    ASSERT(current_length >= 0);
-
-    /* We have a single double indirection block */
-    /*  Each double indirection block entry points to a single indirection
-        block. Each single indirection block points to 128 sectors, or
-        2**16 bytes, or 0..65535. Therefore, int-dividing the current length
-        by 65536, we see that the quotient is the index into the double
-        indirection array, at the current length */
-    if (current_length == 0) {
-        *base_first_index = 0;
-        *base_second_index = 0;
-    } else {
-        *base_first_index = (current_length-1) >> 16;
-        /*  The remainder of this division, itself divided by 512, is the index
-            into the single indirection block. */
-        *base_second_index = ((current_length-1) - 
-                (*base_first_index << 16)) >> 9;
-    }
+/*! The way from an on-disk inode to one logical block of its file. */
+struct index_path {
+    uint32_t root;              /*!< Which pointer in the inode, see 
+                                     index_root. */
+    int depth;                  /*!< Indirection blocks on the way. */
+    uint32_t index[2];          /*!< Entry to follow in each of them. */
+};
+
+/*! Number of pointers at the top of the index in the on-disk inode: the
+    direct ones, then the single and the doubly indirect one. */
+#define INODE_INDEX_ROOTS (INODE_DIRECT_BLOCKS + 2)
+
+/*! Returns the pointer number ROOT at the top of DATA's index. */
+static block_sector_t *index_root(struct inode_disk *data, uint32_t root) {
+    ASSERT(root < INODE_INDEX_ROOTS);
+    if (root < INODE_DIRECT_BLOCKS)
+        return &data->direct[root];
+    if (root == INODE_DIRECT_BLOCKS)
+        return &data->single_indirect;
+    return &data->doubly_indirect;
+}
 
-    if (final_length == 0) {
-        *final_first_index = 0;
-        *final_second_index = 0;
-    } else {
-        /* We can easily get the final indices the same way */
-        *final_first_index = (final_length-1) >> 16;
-        *final_second_index = ((final_length-1) - 
-            (*final_first_index << 16)) >> 9;
-    }    
+/*! Returns how many indirection blocks lie under index root ROOT, and 
+    stores the first logical block it maps into *BASE. */
+static int index_root_depth(uint32_t root, uint32_t *base) {
+    if (root < INODE_DIRECT_BLOCKS) {
+        *base = root;
+        return 0;
+    }
+    *base = INODE_DIRECT_BLOCKS;
+    if (root == INODE_DIRECT_BLOCKS)
+        return 1;
+    *base += INDIRECTION_REFERENCES;
+    return 2;
 }
 
+/*! Works out PATH to logical block BLOCK. */
+static void index_path_of(uint32_t block, struct index_path *path) {
+    if (block < INODE_DIRECT_BLOCKS) {
+        path->root = block;
+        path->depth = 0;
+        return;
+    }
+    block -= INODE_DIRECT_BLOCKS;
+    if (block < INDIRECTION_REFERENCES) {
+        path->root = INODE_DIRECT_BLOCKS;
+        path->depth = 1;
+        path->index[0] = block;
+        return;
+    }
+    block -= INDIRECTION_REFERENCES;
+    ASSERT(block < INDIRECTION_REFERENCES * INDIRECTION_REFERENCES);
+    path->root = INODE_DIRECT_BLOCKS + 1;
+    path->depth = 2;
+    path->index[0] = block / INDIRECTION_REFERENCES;
+    path->index[1] = block % INDIRECTION_REFERENCES;
+}
 
-/*! 
-    Extends an inode on disk at SECTOR with CURRENT_LENGTH bytes of data
-    to handle FUTURE_LENGTH bytes of data. Does not modify inode metadata
-    on disk or in memory other than adding index references. e.g. update
-    the length yourself!
-
-    You must enter this function with a file extension lock held.
-
-    Returns false and de-allocates the sectors handled, 
-    if memory or disk allocation fails and !FAILURE_ACCEPTABLE. Otherwise
-    changes future_length from whatever you requested to what actually
-    was allocated.
-
-    If create_double_indirection is true, will allocate a doubly indirect 
-    index sector and return its sector on disk in DOUBLY_INDIRECT. 
-    Otherwise, will expect that pointer to be the double indirection reference
-    for your inode in question, except in the case of failure to create
-    a length-zero inode, in which case cleaning up means deleting the
-    initial indirection blocks, too.
-    
-    It is the caller's responsibility to interpret the updated future_length
-    and boolean return value and change the inode_disk file length.
-    */
-static bool inode_extend(   bool create_double_indirection, 
-                            block_sector_t* doubly_indirect_, 
-                            off_t current_length, 
-                            off_t* future_length,
-                            bool failure_acceptable) {
+/*! Returns how many logical blocks from BLOCK on share the last index block
+    on BLOCK's path, or the direct pointers, counting BLOCK. */
+static uint32_t index_blocks_left(uint32_t block) {
+    struct index_path path;
 
-    // printf("SDEBUG: current_length %d\n", current_length);
+    index_path_of(block, &path);
+    if (path.depth == 0)
+        return INODE_DIRECT_BLOCKS - block;
+    return INDIRECTION_REFERENCES - path.index[path.depth - 1];
+}
 
-    ASSERT(current_length >= 0);    
-    ASSERT(current_length <= *future_length);
+/*! Returns the data sector of logical block BLOCK of the file whose on-disk
+    inode is at INODE_SECTOR, walking its index. Returns SILLY_OLD_DISK_SECTOR
+    if the block has no data sector. */
+static block_sector_t index_lookup(block_sector_t inode_sector, 
+                                   uint32_t block) {
+    struct index_path path;
+    struct inode_disk *data;
+    struct indirection_block *reference;
+    block_sector_t result;
+    cache_sector_id src;
+    int level;
 
-    struct indirection_block *emptiness = NULL;        
+    index_path_of(block, &path);
 
-    uint32_t base_first_index, base_second_index, first_index, second_index;         
-    volatile cache_sector_id data, singly, doubly;
-    uint32_t first_sweep, second_sweep;
-    bool double_indirection_flag;
+    src = crab_into_cached_sector_of_class(inode_sector, true, false,
+                                           CACHE_CLASS_INODE); 
+    data = (struct inode_disk *) get_cache_sector_base_addr(src);            
+    result = *index_root(data, path.root);
+    crab_outof_cached_sector(src, true);        
 
-    bool first_sweep_flag = true;
-    bool second_sweep_flag = true;
+    for (level = 0; level < path.depth; level++) {
+        if (result == SILLY_OLD_DISK_SECTOR)
+            break;
+        src = crab_into_cached_sector_of_class(result, true, false,
+                                               CACHE_CLASS_INDIRECT); 
+        reference = 
+            (struct indirection_block *) get_cache_sector_base_addr(src);
+        result = reference->sector[path.index[level]];
+        crab_outof_cached_sector(src, true);        
+    }
+    return result;
+}
 
-    bool new_single_indirection_block_flag, new_data_block_flag;    
-    uint32_t second_sweep_start, second_sweep_limit;                        
-    block_sector_t single_indirection_sector, data_sector;            
-    struct indirection_block *cached_single_indirection_sector;
-    struct indirection_block *cached_double_indirection_sector;
+/*! Allocates a fresh index block, as soon after HINT on disk as it can, 
+    and stores it in *SECTORP. Returns false if the disk is full. */
+static bool index_block_allocate(block_sector_t hint, block_sector_t *sectorp) {
+    struct indirection_block *reference;
+    cache_sector_id dst;
 
-    /*  Flags to help with cleanup */
-    bool cleanup_double_indirection_on_error = false;
-    bool cleanup_first_single_indirection_on_error = false;
-    bool cleanup_first_data_sector_on_error = false;
-    bool first_second_sweep_flag = false;
+    if (free_map_allocate_run(hint + 1, 1, sectorp) == 0)
+        return false;
 
-    /* This function can ONLY be used for extension */
-    if (*future_length == 0) {    
-        
-        *doubly_indirect_ = SILLY_OLD_DISK_SECTOR;
-        return true;    
-    }
+    /* Every entry starts out as a sentinel, nothing's allocated yet. */
+    dst = crab_into_cached_sector_of_class(*sectorp, false, true,
+                                           CACHE_CLASS_INDIRECT);
+    reference = (struct indirection_block *) get_cache_sector_base_addr(dst);
+    memset((void *) reference, (int) ((unsigned char) 0xFF), 
+           BLOCK_SECTOR_SIZE);
+    crab_outof_cached_sector(dst, false);
+    return true;
+}
 
-    emptiness = calloc(1, sizeof(*emptiness));
+/*! Points logical block BLOCK of the file whose on-disk inode is at 
+    INODE_SECTOR to data sector DATA_SECTOR, allocating the index blocks on 
+    the way if need be. You must hold the file extension lock, or be 
+    creating the file.
 
-    if (emptiness != NULL) {
-        /*  Set all entries in emptiness to SILLY_OLD_DISK_SECTOR,
-            as our sentinels */
-        memset( (void *) emptiness, 
-                (int) ((unsigned char) 0xFF),
-                BLOCK_SECTOR_SIZE);
-    } else {
-        
-        *future_length = current_length;
-        if (create_double_indirection) {
-            *future_length = 0;
-            *doubly_indirect_ = SILLY_OLD_DISK_SECTOR;
+    Returns false, leaving any index blocks it allocated in place, if the
+    disk is full. */
+static bool index_install(block_sector_t inode_sector, uint32_t block,
+                          block_sector_t data_sector) {
+    struct index_path path;
+    struct inode_disk *data;
+    struct indirection_block *reference;
+    block_sector_t *entry, sector, next;
+    cache_sector_id src;
+    int level;
+
+    index_path_of(block, &path);
+
+    /*  Walk down one sector at a time. Nobody else extends this file, so 
+        a sentinel we read stays one while we allocate outside the crab, 
+        and we never hold two cache sectors at once. */
+    sector = inode_sector;
+    for (level = 0; level <= path.depth; level++) {
+        src = crab_into_cached_sector_of_class(sector, true, false, 
+            level == 0 ? CACHE_CLASS_INODE : CACHE_CLASS_INDIRECT);
+        if (level == 0) {
+            data = (struct inode_disk *) get_cache_sector_base_addr(src);
+            next = *index_root(data, path.root);
+        } else {
+            reference = 
+                (struct indirection_block *) get_cache_sector_base_addr(src);
+            next = reference->sector[path.index[level - 1]];
         }
-        return false;
-    }    
+        crab_outof_cached_sector(src, true);
 
-    /* Find the indirection blocks necessary for length bytes */                      
-    get_indirection_indices(&base_first_index, &base_second_index, 
-                            &first_index, &second_index, 
-                            current_length, *future_length);
-    
-    off_t current_delta_to_sector_edge = BLOCK_SECTOR_SIZE - 
-                (current_length % BLOCK_SECTOR_SIZE);
-    off_t target_length = *future_length;    
-
-    /* From now on, we count up as we allocate. */
-    *future_length = current_length;
-
-    /*  In the case of creation, we don't have a doubly indirect sector
-    to start with. Let's get one. */
-    if (create_double_indirection) {
-        double_indirection_flag = 
-            free_map_allocate(1, doubly_indirect_);                    
-        if (!double_indirection_flag) {
-            free(emptiness);   
-            
-            *doubly_indirect_ = SILLY_OLD_DISK_SECTOR;
-            *future_length = 0;         
-            return false;
+        if (next == SILLY_OLD_DISK_SECTOR) {
+            if (level == path.depth)
+                next = data_sector;
+            else if (!index_block_allocate(data_sector, &next))
+                return false;
+
+            src = crab_into_cached_sector_of_class(sector, false, false, 
+                level == 0 ? CACHE_CLASS_INODE : CACHE_CLASS_INDIRECT);
+            if (level == 0) {
+                data = (struct inode_disk *) get_cache_sector_base_addr(src);
+                entry = index_root(data, path.root);
+            } else {
+                reference = (struct indirection_block *) 
+                    get_cache_sector_base_addr(src);
+                entry = &reference->sector[path.index[level - 1]];
+            }
+            *entry = next;
+            crab_outof_cached_sector(src, false);
         }
-        cleanup_double_indirection_on_error = true;
-    } else {
-        ASSERT(*doubly_indirect_ != SILLY_OLD_DISK_SECTOR);
+        ASSERT(level < path.depth || next == data_sector);
+        sector = next;
     }
+    return true;
+}
 
-    block_sector_t doubly_indirect = *doubly_indirect_;
-
-    /*  Bring this doubly indirect map in, cache, pin, and clear it if 
-        necessary */                    
-    doubly = crab_into_cached_sector(doubly_indirect, 
-                                        false, 
-                                        create_double_indirection);                        
+/*! Frees the data sectors of logical blocks FIRST and up under index block
+    SECTOR, which is DEPTH levels above the data and maps logical blocks
+    from BASE on, and sets their entries to sentinels. Frees SECTOR too if
+    all it maps goes, and returns true if so. */
+static bool index_release_tree(block_sector_t sector, int depth, 
+                               uint32_t base, uint32_t first) {
+    struct indirection_block *reference;
+    block_sector_t child;
+    cache_sector_id src;
+    uint32_t span = depth == 1 ? 1 : INDIRECTION_REFERENCES;
+    uint32_t i = first > base ? (first - base) / span : 0;
+
+    for (; i < INDIRECTION_REFERENCES; i++) {
+        src = crab_into_cached_sector_of_class(sector, true, false,
+                                               CACHE_CLASS_INDIRECT);
+        reference = (struct indirection_block *)
+                    get_cache_sector_base_addr(src);
+        child = reference->sector[i];
+        crab_outof_cached_sector(src, true);
 
-    cached_double_indirection_sector = 
-        (struct indirection_block *) get_cache_sector_base_addr(doubly);
+        if (child == SILLY_OLD_DISK_SECTOR)
+            continue;
+        if (depth > 1) {
+            if (!index_release_tree(child, depth - 1, base + i * span, first))
+                continue;
+        } else {
+            free_map_release(child, 1);
+        }
 
-    if (create_double_indirection) {
-        memcpy( (void *) cached_double_indirection_sector, 
-                (void *) emptiness, 
-                (size_t) BLOCK_SECTOR_SIZE );                     
+        src = crab_into_cached_sector_of_class(sector, false, false,
+                                               CACHE_CLASS_INDIRECT);
+        reference = (struct indirection_block *)
+                    get_cache_sector_base_addr(src);
+        reference->sector[i] = SILLY_OLD_DISK_SECTOR;
+        crab_outof_cached_sector(src, false);
     }
 
-    /*  Want to avoid pinning several cache sectors in sequence,
-        has the potential for deadlock if we over-constrain the 
-        cache */
-    crab_outof_cached_sector( doubly, false );                
-
-    /*  Now, sweep through and allocate all the first level indirection
-        sectors. */                        
-    for (   first_sweep = base_first_index; 
-            first_sweep < first_index+1; 
-            first_sweep++) {                
-
-        /* Allocate and remember the next single indirection sector */
-        doubly = crab_into_cached_sector(doubly_indirect, 
-                                            false, 
-                                            false);
-        cached_double_indirection_sector = 
-            (struct indirection_block *) 
-                get_cache_sector_base_addr(doubly);
-        
-        single_indirection_sector = 
-            cached_double_indirection_sector->sector[first_sweep];
-
-        first_sweep_flag = true;
-        new_single_indirection_block_flag = false;
-        if (single_indirection_sector == SILLY_OLD_DISK_SECTOR) {
-            new_single_indirection_block_flag = true;
-            if (first_sweep == base_first_index) {
-                cleanup_first_single_indirection_on_error = true;
-            }
-            first_sweep_flag = free_map_allocate(1, 
-                                    &single_indirection_sector);            
-            if (first_sweep_flag) {               
-                cached_double_indirection_sector->sector[first_sweep] = 
-                    single_indirection_sector;                            
-            }
-        } 
+    if (first > base)
+        return false;
+    free_map_release(sector, 1);
+    return true;
+}
 
-        /*  Want to avoid pinning several cache sectors in sequence,
-            has the potential for deadlock if we over-constrain the 
-            cache */
-        crab_outof_cached_sector( doubly, false );
-        
-        if (!first_sweep_flag) {          
-            /* Release disk allocations immediately outside this loop */
-            break;
-        } 
+/*! Frees the data sectors of logical blocks FIRST and up of the file whose 
+    on-disk inode is at INODE_SECTOR, and the index blocks left mapping 
+    nothing, leaving sentinels in their place. Rolls back a failed extension,
+    or with FIRST 0, frees everything but the inode sector itself. You must
+    hold the file extension lock, or be the last one with the file. */
+static void index_release(block_sector_t inode_sector, uint32_t first) {
+    struct inode_disk *data;
+    block_sector_t sector;
+    cache_sector_id src;
+    uint32_t root, base;
+    int depth;
+
+    for (root = 0; root < INODE_INDEX_ROOTS; root++) {
+        depth = index_root_depth(root, &base);
+        if (depth == 0 && base < first)
+            continue;
+
+        src = crab_into_cached_sector_of_class(inode_sector, true, false,
+                                               CACHE_CLASS_INODE);
+        data = (struct inode_disk *) get_cache_sector_base_addr(src);
+        sector = *index_root(data, root);
+        crab_outof_cached_sector(src, true);
 
-        /*  Now the double indirection sector contains a reference
-        to a single indirection sectors that we need to cache, clear,
-        then flesh out with cleared data sector references */
-        
-        /* Cache the single indirection sector */                        
-        singly = crab_into_cached_sector(single_indirection_sector, 
-                                            false, 
-                                            new_single_indirection_block_flag);
-
-        cached_single_indirection_sector = 
-            (struct indirection_block *) 
-                get_cache_sector_base_addr(singly);
-
-        if (new_single_indirection_block_flag) {
-            memcpy( (void *) cached_single_indirection_sector, 
-                    (void *) emptiness, 
-                    (size_t) BLOCK_SECTOR_SIZE );               
-        }  
-
-        crab_outof_cached_sector(singly, false);                                                    
-
-        /* Set up to get and clear second_sweep_limit data sectors */
-        first_second_sweep_flag = false;
-        if (first_sweep == first_index && first_index != base_first_index) {
-            /*  Extension crosses single indirection block boundaries,
-                and we're not on the first block */
-            second_sweep_start = 0;
-            second_sweep_limit = second_index+1;            
-        } else if (first_sweep == first_index) {
-            /*  Extension occurs in one single indirection block, */
-            second_sweep_start = base_second_index;
-            second_sweep_limit = second_index+1;
-            first_second_sweep_flag = true;
-        } else if (first_sweep == base_first_index) {
-            /*  Extension occurs over multiple single indirection blocks, 
-                and we're at the first. */
-            second_sweep_start = base_second_index;
-            second_sweep_limit = ((uint32_t) INDIRECTION_REFERENCES); 
-            first_second_sweep_flag = true;
+        if (sector == SILLY_OLD_DISK_SECTOR)
+            continue;
+        if (depth > 0) {
+            if (!index_release_tree(sector, depth, base, first))
+                continue;
         } else {
-            second_sweep_start = 0;
-            second_sweep_limit = ((uint32_t) INDIRECTION_REFERENCES);            
-        }        
-
-        for (   second_sweep = second_sweep_start; 
-                second_sweep < second_sweep_limit; 
-                second_sweep++) {
-            singly = crab_into_cached_sector(single_indirection_sector, 
-                                            false, 
-                                            false);
-            cached_single_indirection_sector = 
-                (struct indirection_block *) 
-                    get_cache_sector_base_addr(singly);
-
-            /* Allocate the next data sector if it doesn't exist already */
-            data_sector = 
-                cached_single_indirection_sector->sector[second_sweep];
-
-            second_sweep_flag = true;
-            new_data_block_flag = false;
-            if (data_sector == SILLY_OLD_DISK_SECTOR) {
-                if ( (second_sweep == second_sweep_start) &&
-                     first_second_sweep_flag ) {
-                    cleanup_first_data_sector_on_error = true;
-                }
-                new_data_block_flag = true;
-                second_sweep_flag = 
-                    free_map_allocate(
-                        1, 
-                        &data_sector );
-
-                if (second_sweep_flag)       
-                    cached_single_indirection_sector->sector[second_sweep] = 
-                        data_sector;
-            }
-                                                                    
-            crab_outof_cached_sector(singly, false); 
-
-            if (!second_sweep_flag) {
-                /*  Release disk allocations immediately 
-                    outside this loop */
-                break;
-            }
+            free_map_release(sector, 1);
+        }
 
-            /* Now, cache and clear the data sector */
-            if (new_data_block_flag) {        
+        src = crab_into_cached_sector_of_class(inode_sector, false, false,
+                                               CACHE_CLASS_INODE);
+        data = (struct inode_disk *) get_cache_sector_base_addr(src);
+        *index_root(data, root) = SILLY_OLD_DISK_SECTOR;
+        crab_outof_cached_sector(src, false);
+    }
+}
 
-                data = crab_into_cached_sector(data_sector, false, true);
-                crab_outof_cached_sector(data, false);                    
+/*! 
+    Gives data sectors to the blocks of the file whose on-disk inode is at
+    INODE_SECTOR, with CURRENT_LENGTH bytes of data, that hold bytes START
+    to FUTURE_LENGTH and don't have one yet. Those past CURRENT_LENGTH never
+    do, those before it may be holes that have never been written. Allocates
+    and clears data sectors, and the index blocks to reach them, but does 
+    not modify the length on disk or in memory. e.g. update the length 
+    yourself!
+
+    You must enter this function with a file extension lock held, or be
+    creating the file.
+
+    Data sectors are allocated in runs, as many at a time as the rest of
+    the index block (or the direct pointers) they go in needs, each run 
+    starting right after the last data sector if possible, and new index
+    blocks right after the data sector that needed them. So a file grown 
+    in one go mostly lies in a few extents, which read ahead in few 
+    requests.
+
+    If DIRECT, the caller is about to write bytes START to FUTURE_LENGTH
+    straight to disk, so blocks it will cover whole, past CURRENT_LENGTH
+    where no reader can see them till the length is set, aren't cleared.
+    Clearing them would go through the cache, and the direct write would
+    then have to as well.
+
+    Returns false and de-allocates the sectors handled, if disk allocation
+    fails and !FAILURE_ACCEPTABLE, which is only for files with nothing 
+    allocated from START on. Otherwise changes future_length from whatever
+    you requested to as far as every block from START on has a sector.
+    */
+static bool inode_extend(block_sector_t inode_sector, off_t current_length,
+                         off_t start, off_t *future_length, 
+                         bool failure_acceptable, bool direct) {
+    uint32_t first = start / BLOCK_SECTOR_SIZE;
+    uint32_t end = DIV_ROUND_UP(*future_length, BLOCK_SECTOR_SIZE);
+    uint32_t allocated = DIV_ROUND_UP(current_length, BLOCK_SECTOR_SIZE);
+    uint32_t block, want;
+    block_sector_t run_next = SILLY_OLD_DISK_SECTOR, hint, sector;
+    size_t run_left = 0;
+    cache_sector_id dst;
+    bool success = true;
+
+    ASSERT(start <= *future_length);
+
+    /* Carry on where the file leaves off, or from its inode. */
+    hint = first > 0 ? index_lookup(inode_sector, first - 1) : inode_sector;
+    if (hint == SILLY_OLD_DISK_SECTOR)
+        hint = inode_sector;
+
+    for (block = first; block < end; block++) {
+        /* Skip what's been written already. */
+        if (block < allocated) {
+            sector = index_lookup(inode_sector, block);
+            if (sector != SILLY_OLD_DISK_SECTOR) {
+                hint = sector;
+                continue;
             }
+        }
 
-            if (    (first_sweep == first_index) && 
-                    (second_sweep == second_index) ) {                
-                /* Last sector possibly not fully utilized */
-                *future_length = target_length;            
-            } else if (first_second_sweep_flag) {
-                /* First sector of many - possibly already allocated */
-                *future_length += current_delta_to_sector_edge;
-            } else {
-                *future_length += BLOCK_SECTOR_SIZE;
+        if (run_left == 0) {
+            want = index_blocks_left(block);
+            if (want > end - block)
+                want = end - block;
+            run_left = free_map_allocate_run(hint + 1, want, &run_next);
+            if (run_left == 0) {
+                success = false;
+                break;
             }
         }
 
-        if (!second_sweep_flag) {
+        /* Clear the data sector before anyone can find it in the index,
+           unless a direct write is about to fill it. */
+        if (!direct || (off_t) block * BLOCK_SECTOR_SIZE < current_length ||
+            (off_t) block * BLOCK_SECTOR_SIZE < start ||
+            (off_t) (block + 1) * BLOCK_SECTOR_SIZE > *future_length) {
+            dst = crab_into_cached_sector(run_next, false, true);
+            crab_outof_cached_sector(dst, false);
+        }
+
+        if (!index_install(inode_sector, block, run_next)) {
+            success = false;
             break;
         }
-    }                        
-
-    /* Clean up if things went wrong */
-    if (!failure_acceptable && (!first_sweep_flag || !second_sweep_flag) ) {  
-
-        cleanup_failed_extension(   base_first_index, 
-                                    base_second_index,                                    
-                                    doubly_indirect_,
-                                    cleanup_double_indirection_on_error,
-                                    cleanup_first_single_indirection_on_error,
-                                    cleanup_first_data_sector_on_error);      
-        /* Clean up till our starting position */
-        *future_length = current_length;                                  
-        free(emptiness);
-        return false;
-    } 
-    
-    /* future_length is as far as we got */    
+        hint = run_next++;
+        run_left--;
+    }
 
-    free(emptiness);
+    /* Give back what's left of the last run, if we didn't need it all. */
+    if (run_left > 0)
+        free_map_release(run_next, run_left);
+
+    if (!success) {
+        if (!failure_acceptable) {
+            /* Clean up till our starting position, and make sure
+               nobody goes on finding what we gave back. */
+            index_release(inode_sector, first);
+            inode_map_forget(inode_sector, first);
+            *future_length = start;
+            return false;
+        }
+        /* future_length is as far as we got */
+        if ((off_t) block * BLOCK_SECTOR_SIZE < *future_length)
+            *future_length = (off_t) block * BLOCK_SECTOR_SIZE;
+        if (*future_length < start)
+            *future_length = start;
+    }
     return true;
 }
 
@@ -496,250 +595,147 @@ bool inode_create(block_sector_t sector, off_t length,
         disk_inode->magic = INODE_MAGIC;
         strlcpy(disk_inode->filename, filename, NAME_MAX + 1);
         disk_inode->parent_dir = parent;
-        if (is_directory) {
-        	disk_inode->is_dir = true;
-        	int i;
-        	for (i = 0; i < MAX_DIR_ENTRIES; i++) {
-        		disk_inode->dir_contents[i] = BOGUS_SECTOR;
-        	}
+        disk_inode->is_dir = is_directory;
+
+        /* Nothing's allocated yet. Small files and directories start out
+           inline, calloc zeroed their data. Other files get their length
+           once they have the data sectors for it. */
+        int i;
+        for (i = 0; i < INODE_DIRECT_BLOCKS; i++) {
+            disk_inode->direct[i] = SILLY_OLD_DISK_SECTOR;
         }
-        else {
-        	disk_inode->is_dir = false;
+        disk_inode->single_indirect = SILLY_OLD_DISK_SECTOR;
+        disk_inode->doubly_indirect = SILLY_OLD_DISK_SECTOR;
+        disk_inode->is_inline = length <= INODE_INLINE_BYTES;
+        if (!disk_inode->is_inline)
+            disk_inode->length = 0;
+
+        /* Write the disk_inode to disk, too! */
+        cache_sector_id di = crab_into_cached_sector_of_class(sector, 
+                false, true, CACHE_CLASS_INODE);
+        cache_write(di, (void *) disk_inode, 0, BLOCK_SECTOR_SIZE);
+        crab_outof_cached_sector(di, false);
+
+        success = true;
+        if (!disk_inode->is_inline && length > 0) {
+            success = inode_extend(sector, 0, 0, &length, false, false);
+            if (success) {
+                di = crab_into_cached_sector_of_class(sector, false, false, 
+                                                      CACHE_CLASS_INODE);
+                ((struct inode_disk *) get_cache_sector_base_addr(di))->length 
+                    = length;
+                crab_outof_cached_sector(di, false);
+            }
         }
-
-        if (inode_extend(true, &disk_inode->doubly_indirect, 0,
-				&disk_inode->length, false)) {
-			/* Write the disk_inode to disk, too! */
-			cache_sector_id di = crab_into_cached_sector(sector, false, true);
-			cache_write(di, (void *) disk_inode, 0, BLOCK_SECTOR_SIZE);
-			crab_outof_cached_sector(di, false);
-
-			if (length > 0) {
-				ASSERT(disk_inode->doubly_indirect != SILLY_OLD_DISK_SECTOR);
-			}
-			success = true;
-		}
         free(disk_inode);
     }
     return success;
 }
 
-/*! Called to push directory inode metadata to the disk. */
-static void synch_directory_inode_to_disk (struct inode *i) {
-    struct inode_disk *disk_dir;
-    cache_sector_id dir = crab_into_cached_sector(i->sector, false, false);
-    disk_dir = (struct inode_disk *) get_cache_sector_base_addr(dir);    
-    if (disk_dir->is_dir) {
-        disk_dir->parent_dir = i->parent_dir;
-        memcpy((void *) &disk_dir->dir_contents, 
-                (void *) &i->dir_contents, 
-                (size_t) (MAX_DIR_ENTRIES * sizeof(block_sector_t) ) );  
-    }
-    crab_outof_cached_sector(dir, false);
-}
+/*! Pins INODE's on-disk inode, and its single and doubly indirect blocks,
+    if it has them, in the cache, so every byte_to_sector of a file that's 
+    open doesn't have to go to disk for them first. Takes what pins the
+    cache will give us, and does nothing for pins INODE already holds. */
+static void inode_pin_index(struct inode *inode) {
+    block_sector_t single, doubly;
 
-/*! Cleans up after a failed file extension, either during creation or afterward
-    A file extension lock must be held on the inode prior to entry.
-
-    Starts at base_first_index and base_second index, and goes until
-    it sees silly references in the index referenced by doubly_indirect.
-    It frees this index sector as well if the base indices are both zero,
-    as this indicates the file had length zero before. 
-
-    It is up to the caller to free their inode_disk and inode (if necessary) 
-    depending on the circumstances under which this function was called. */
-static void cleanup_failed_extension(  uint32_t base_first_index, 
-                                uint32_t base_second_index, 
-                                block_sector_t *doubly_indirect_,
-                                bool cleanup_double_indirection_on_error,
-                                bool cleanup_first_single_indirection_on_error,
-                                bool cleanup_first_data_sector_on_error) {
-    volatile cache_sector_id singly, doubly;
-    uint32_t first_sweep, second_sweep, second_sweep_start;    
-    block_sector_t single_indirection_sector, data_sector, doubly_indirect;            
-    struct indirection_block *cached_single_indirection_sector;
-    struct indirection_block *cached_double_indirection_sector;
-    bool first_si_flag = true;
-    bool first_ds_flag = true;
-
-    doubly_indirect = *doubly_indirect_;
-
-    for (first_sweep = base_first_index; 
-        first_sweep < ((uint32_t) INDIRECTION_REFERENCES); 
-        first_sweep++) {
-        /* Get single indirection referenced if it's not silly */
-
-        doubly = crab_into_cached_sector(doubly_indirect, 
-                                            false, 
-                                            false);
-        cached_double_indirection_sector = 
-            (struct indirection_block *) 
-                get_cache_sector_base_addr(doubly);
-        
-        single_indirection_sector = 
-            cached_double_indirection_sector->sector[first_sweep];        
+    if (!inode->sector_pinned)
+        inode->sector_pinned = cache_pin(inode->sector, CACHE_CLASS_INODE);
 
-        if (single_indirection_sector == SILLY_OLD_DISK_SECTOR ) {
-            /* No more! */
-            crab_outof_cached_sector( doubly, false );  
-            break;
-        } else {                    
-        /*  Replace single indirection reference with a silly reference. 
-            Not strictly necessary for creation cleanup, but 
-            it is necessary if we're just cleaning up a failed
-            extension.
-
-            Note that this isn't preserving the linear contiguous 
-            structure of the disk_inode index, so we'd better have a 
-            file lock (on this file) as we do this */
-            if (first_si_flag && cleanup_first_single_indirection_on_error) {
-                cached_double_indirection_sector->sector[first_sweep] = 
-                    SILLY_OLD_DISK_SECTOR;                                
-            }
-
-        }
-
-        /*  Want to avoid pinning several cache sectors in sequence,
-            has the potential for deadlock if we over-constrain the 
-            cache */
-        crab_outof_cached_sector( doubly, false );                
-        
-        if (first_sweep == base_first_index)
-            second_sweep_start = base_second_index;
-        else 
-            second_sweep_start = 0;
-
-        for (   second_sweep = second_sweep_start; 
-                second_sweep < ((uint32_t) INDIRECTION_REFERENCES); 
-                second_sweep++) {
-            /* Get data sector referenced if it's not silly */
-            singly = crab_into_cached_sector(single_indirection_sector,
-                                                false, false);
-            cached_single_indirection_sector = 
-                (struct indirection_block *) 
-                    get_cache_sector_base_addr(singly);
-        
-            data_sector = 
-                cached_single_indirection_sector->sector[second_sweep];            
-            
-            if (data_sector == SILLY_OLD_DISK_SECTOR ) {
-                /* No more! */                
-                crab_outof_cached_sector( singly, false );                
-                break;
-            } else {                    
-            /*  Replace data reference with a silly reference. 
-                Not strictly necessary for creation cleanup, but 
-                it is necessary if we're just cleaning up a failed
-                extension.
-
-                Note that this isn't preserving the linear contiguous 
-                structure of the disk_inode index, so we'd better have a
-                file lock (on this file) as we do this */
-
-                cached_single_indirection_sector->sector[second_sweep]= 
-                    SILLY_OLD_DISK_SECTOR;                
-            }
-
-            /*  Want to avoid pinning several cache sectors in sequence,
-                has the potential for deadlock if we over-constrain the 
-                cache */            
-            crab_outof_cached_sector( singly, false );                
-
-            /* Remove data sector from the free-map */
-            if (!first_ds_flag ||
-                (cleanup_first_data_sector_on_error && first_ds_flag) ) {
-                free_map_release(data_sector, 1);                    
-            }
-
-            first_ds_flag = false;
-        }
-
-        /* Remove single indirection reference from the free-map */
-        if (!first_si_flag || 
-            (cleanup_first_single_indirection_on_error && first_si_flag) ) {
-            free_map_release(single_indirection_sector, 1);
-        }
-
-        first_si_flag = false;
-    }
-
-    /*  Free double indirection reference from free-map */
-    if (cleanup_double_indirection_on_error) {
-        free_map_release(doubly_indirect, 1);
-        *doubly_indirect_ = SILLY_OLD_DISK_SECTOR;
-    }
+    cache_sector_id src = crab_into_cached_sector_of_class(inode->sector, 
+        true, false, CACHE_CLASS_INODE);
+    struct inode_disk *data = 
+        (struct inode_disk *) get_cache_sector_base_addr(src);
+    single = data->single_indirect;
+    doubly = data->doubly_indirect;
+    crab_outof_cached_sector(src, true);
+
+    if (inode->pinned_single == SILLY_OLD_DISK_SECTOR && 
+        single != SILLY_OLD_DISK_SECTOR &&
+        cache_pin(single, CACHE_CLASS_INDIRECT))
+        inode->pinned_single = single;
+    if (inode->pinned_doubly == SILLY_OLD_DISK_SECTOR && 
+        doubly != SILLY_OLD_DISK_SECTOR &&
+        cache_pin(doubly, CACHE_CLASS_INDIRECT))
+        inode->pinned_doubly = doubly;
 }
 
 /*! Reads an inode from SECTOR
     and returns a `struct inode' that contains it.
     Returns a null pointer if memory allocation fails. */
 struct inode * inode_open(block_sector_t sector) {
-    struct list_elem *e;
+    struct open_inode_stripe *stripe = open_inodes_stripe(sector);
+    struct hash_elem *e;
     struct inode *inode;    
 
     /* Check whether this inode is already open. */
-        lock_acquire(&open_inodes_lock);
-
-    /* Check whether this inode is already open. */
-    for (e = list_begin(&open_inodes); e != list_end(&open_inodes);
-         e = list_next(e)) {
-        inode = list_entry(e, struct inode, elem);
-        if (inode->sector == sector) {
-            inode_reopen(inode);
-            lock_release(&open_inodes_lock);
-            return inode; 
-        }
-    }    
+    lock_acquire(&stripe->lock);
+    stripe->probe.sector = sector;
+    e = hash_find(&stripe->inodes, &stripe->probe.elem);
+    if (e != NULL) {
+        inode = hash_entry(e, struct inode, elem);
+        inode_reopen(inode);
+        while (inode->loading)
+            cond_wait(&stripe->loaded, &stripe->lock);
+        lock_release(&stripe->lock);
+        return inode; 
+    }
 
     /* Allocate memory. */
     inode = malloc(sizeof *inode);
     if (inode == NULL) {
-    	lock_release(&open_inodes_lock);
+    	lock_release(&stripe->lock);
     	return NULL;
     }
 
     /* Initialize. */
-    list_push_front(&open_inodes, &inode->elem);
 	inode->sector = sector;
+    hash_insert(&stripe->inodes, &inode->elem);
 	inode->open_cnt = 1;
 	inode->deny_write_cnt = 0;
 	inode->removed = false;
+	inode->loading = true;
+	inode->ra_next = 0;
+	inode->ra_queued = 0;
+	inode->ra_window = 0;
+	inode->sector_pinned = false;
+	inode->pinned_single = SILLY_OLD_DISK_SECTOR;
+	inode->pinned_doubly = SILLY_OLD_DISK_SECTOR;
 	lock_init(&inode->extension_lock);
 	lock_init(&inode->ismd_lock);
-
-    /* Read the inode from disk to see if it's a directory. If it is then
-       copy the directory's entries. */
-    void *tmp_buf = malloc ((size_t) BLOCK_SECTOR_SIZE);
-    if (tmp_buf == NULL) {
-    	PANIC("Couldn't malloc enough room for tmp buf.");
-    	NOT_REACHED();
-    }
-
-    /* Fetch the node from the cache (or disk if necessary) */
-    cache_sector_id src = crab_into_cached_sector(inode->sector, true, false);
-	cache_read(src, tmp_buf, 0, BLOCK_SECTOR_SIZE);
+	inode->map = NULL;
+    lock_release(&stripe->lock);
+
+    /* Look at the on-disk inode where it sits in the cache (or bring it in
+       from disk if necessary), to see if it's a directory, and what else we
+       keep a copy of. */
+    cache_sector_id src = crab_into_cached_sector_of_class(inode->sector, 
+        true, false, CACHE_CLASS_INODE);
+    struct inode_disk *data = 
+        (struct inode_disk *) get_cache_sector_base_addr(src);
+    inode->length = data->length;
+    inode->is_dir = data->is_dir;
+    inode->is_inline = data->is_inline;
+    inode->parent_dir = data->parent_dir;
 	crab_outof_cached_sector(src, true);
 
-    struct inode_disk *tmp_inode = (struct inode_disk *) tmp_buf;
-    inode->is_dir = tmp_inode->is_dir;
-    inode->parent_dir = tmp_inode->parent_dir;
-    strlcpy(inode->filename, tmp_inode->filename, NAME_MAX + 1);
-    if (inode->is_dir) {
-		int i;
-		for(i = 0; i < MAX_DIR_ENTRIES; i++) {
-			inode->dir_contents[i] = tmp_inode->dir_contents[i];
-		}
-    }
-    free (tmp_buf);
-    lock_release(&open_inodes_lock);
+    inode_pin_index(inode);
+
+    lock_acquire(&stripe->lock);
+    inode->loading = false;
+    cond_broadcast(&stripe->loaded, &stripe->lock);
+    lock_release(&stripe->lock);
 
     return inode;
 }
 
 /*! Reopens and returns INODE. */
 struct inode * inode_reopen(struct inode *inode) {
-    if (inode != NULL)
+    if (inode != NULL) {
+        lock_acquire(&inode->ismd_lock);
         inode->open_cnt++;
+        lock_release(&inode->ismd_lock);
+    }
     return inode;
 }
 
@@ -756,54 +752,63 @@ void inode_close(struct inode *inode) {
     if (inode == NULL)
         return;
 
+    /*  Dropping the last reference and leaving the open inode table happen
+        together, under the stripe lock, so an inode_open can't find and 
+        reopen an inode that's on its way out. */
+    struct open_inode_stripe *stripe = open_inodes_stripe(inode->sector);
     int open_count;
+    lock_acquire(&stripe->lock);
     lock_acquire(&inode->ismd_lock);
     open_count = --inode->open_cnt;
     lock_release(&inode->ismd_lock);
     
     /* Release resources if this was the last opener. */    
     if (open_count == 0) {
-        /* Remove from inode list. Remember that if directory
+        /* Remove from inode table. Remember that if directory
             removals are thread-safe then when filesys_close is called
             no one else can access this file so open_cnt can only decrease.
             Therefore:            
             once we've made open_cnt thread_safe with ismd_lock, no
             outstanding readers or writers for this file at this point.
-            Therefore we can just remove it from the inodes list, 
+            Therefore we can just remove it from the inodes table, 
             and free all its sectors on disk, with no issues.
             */    
-        lock_acquire(&open_inodes_lock);
-        list_remove(&inode->elem);        
-        lock_release(&open_inodes_lock);        
+        hash_delete(&stripe->inodes, &inode->elem);        
+    }
+    lock_release(&stripe->lock);
+
+    if (open_count == 0) {
+        if (inode->pinned_single != SILLY_OLD_DISK_SECTOR)
+            cache_unpin(inode->pinned_single);
+        if (inode->pinned_doubly != SILLY_OLD_DISK_SECTOR)
+            cache_unpin(inode->pinned_doubly);
+        if (inode->sector_pinned)
+            cache_unpin(inode->sector);
 
         /* Deallocate blocks if removed. */
-        if (inode->removed) {                    
+        if (inode->removed)
             inode_tree_destroy(inode->sector);
-        } else if (inode->is_dir) {
-            synch_directory_inode_to_disk (inode); /* Kludge for directories */
-        }
 
+        free(inode->map);
         free(inode); 
     }
-}      
+}
 
 /*  Intended to destroy and free all of the inode's sectors except the inode
     on disk, itself. Useful if you're sequentially operating through inodes
     and directories and something goes wrong. */
 void inode_tree_destroy(block_sector_t inode_sector) {
-    cache_sector_id src = crab_into_cached_sector(inode_sector, true, false);  
+    cache_sector_id src = crab_into_cached_sector_of_class(inode_sector, 
+        true, false, CACHE_CLASS_INODE);  
 
     struct inode_disk *data = 
         (struct inode_disk *) get_cache_sector_base_addr(src);    
 
-    block_sector_t doubly_indirect = data->doubly_indirect;
+    ASSERT(data->magic == INODE_MAGIC);
         
     crab_outof_cached_sector(src, true);        
 
-    /* Re-appropriated cleanup function, ignore the name */  
-    if (doubly_indirect != SILLY_OLD_DISK_SECTOR) 
-        cleanup_failed_extension(0, 0, &doubly_indirect, true, true, true); 
-
+    index_release(inode_sector, 0);
     free_map_release(inode_sector, 1);
 }
 
@@ -812,16 +817,61 @@ void inode_tree_destroy(block_sector_t inode_sector) {
 void inode_remove(struct inode *inode) {
     ASSERT(inode != NULL);
     inode->removed = true;
+    inode_map_clear(inode);
 }
 
 /*! Reads SIZE bytes from INODE into BUFFER, starting at position OFFSET.
    Returns the number of bytes actually read, which may be less
    than SIZE if an error occurs or end of file is reached. */
 off_t inode_read_at(struct inode *inode, void *buffer_, off_t size, off_t offset) {
+    return inode_read(inode, buffer_, size, offset, false);
+}
+
+/*! Like inode_read_at, but whole sectors go from disk straight to BUFFER,
+    bypassing the cache unless it holds them already. For large streaming
+    reads that would otherwise flush everything else out of the cache. */
+off_t inode_read_at_direct(struct inode *inode, void *buffer_, off_t size, 
+                           off_t offset) {
+    return inode_read(inode, buffer_, size, offset, true);
+}
+
+/*! Counts how many whole sectors, starting with SECTOR at sector-aligned 
+    OFFSET in INODE, lie one after another on disk and within both the SIZE 
+    bytes left to transfer and the LENGTH of INODE. At most CACHE_MAX_RUN. 
+    EXTENDING is as for byte_to_sector. */
+static size_t direct_run_length(struct inode *inode, block_sector_t sector,
+                                off_t offset, off_t size, off_t length,
+                                bool extending) {
+    size_t n = 1;
+    off_t end;
+
+    while (n < CACHE_MAX_RUN) {
+        end = (off_t) (n + 1) * BLOCK_SECTOR_SIZE;
+        if (size < end || length - offset < end ||
+            byte_to_sector(inode, offset + n * BLOCK_SECTOR_SIZE, extending) !=
+            sector + n)
+            break;
+        n++;
+    }
+    return n;
+}
+
+/*! Does the work of inode_read_at, or if DIRECT, of inode_read_at_direct. */
+static off_t inode_read(struct inode *inode, void *buffer_, off_t size, 
+                        off_t offset, bool direct) {
     ASSERT(inode != NULL);
 
     uint8_t *buffer = buffer_;
     off_t bytes_read = 0;
+
+    /* Small files are read straight out of their inode sector, unless 
+       they've just been moved out of it. */
+    if (inode->is_inline) {
+        bytes_read = inode_read_inline(inode, buffer, size, offset);
+        if (bytes_read >= 0)
+            return bytes_read;
+        bytes_read = 0;
+    }
     
     off_t length = inode_length(inode); /* Might change mid-call! */
 
@@ -838,12 +888,25 @@ off_t inode_read_at(struct inode *inode, void *buffer_, off_t size, off_t offset
 
         /* Number of bytes to actually copy out of this sector. */
         int chunk_size = size < min_left ? size : min_left;
-        if ( (chunk_size <= 0) || (sector_idx == SILLY_OLD_DISK_SECTOR) ) 
+        if (chunk_size <= 0) 
             break;        
         
-        cache_sector_id src = crab_into_cached_sector(sector_idx, true, false);            
-        cache_read(src, (void *) (buffer + bytes_read), sector_ofs, chunk_size);        
-        crab_outof_cached_sector(src, true);
+        if (sector_idx == SILLY_OLD_DISK_SECTOR) {
+            /* A hole, which reads as zeros without going to disk. */
+            memset(buffer + bytes_read, 0, chunk_size);
+        } else if (direct && chunk_size == BLOCK_SECTOR_SIZE) {
+            /* Whole sectors, as many as are together on disk. */
+            size_t n = direct_run_length(inode, sector_idx, offset, size, 
+                                         length, false);
+            cache_direct_io(sector_idx, n, buffer + bytes_read, true);
+            chunk_size = n * BLOCK_SECTOR_SIZE;
+        } else {
+            cache_sector_id src = crab_into_cached_sector(sector_idx, true, 
+                                                          false);
+            cache_read(src, (void *) (buffer + bytes_read), sector_ofs, 
+                       chunk_size);
+            crab_outof_cached_sector(src, true);
+        }
       
         /* Advance. */
         size -= chunk_size;
@@ -851,6 +914,11 @@ off_t inode_read_at(struct inode *inode, void *buffer_, off_t size, off_t offset
         bytes_read += chunk_size;
     }
 
+    /* Have what comes next read ahead, if this looks like a stream. Direct
+       readers are streaming, but are keeping out of the cache. */
+    if (!direct)
+        filesys_read_ahead(inode, offset - bytes_read, bytes_read, length);
+
     return bytes_read;
 }
 
@@ -858,6 +926,20 @@ off_t inode_read_at(struct inode *inode, void *buffer_, off_t size, off_t offset
     Returns the number of bytes actually written, which may be
     less than SIZE if file cannot be extended. */
 off_t inode_write_at(struct inode *inode, const void *buffer_, off_t size, off_t offset) {
+    return inode_write(inode, buffer_, size, offset, false);
+}
+
+/*! Like inode_write_at, but whole sectors go from BUFFER straight to disk,
+    bypassing the cache unless it holds them already. */
+off_t inode_write_at_direct(struct inode *inode, const void *buffer_, 
+                            off_t size, off_t offset) {
+    return inode_write(inode, buffer_, size, offset, true);
+}
+
+/*! Does the work of inode_write_at, or if DIRECT, of 
+    inode_write_at_direct. */
+static off_t inode_write(struct inode *inode, const void *buffer_, 
+                         off_t size, off_t offset, bool direct) {
     ASSERT(inode != NULL);    
 
     const uint8_t *buffer = buffer_;
@@ -870,10 +952,24 @@ off_t inode_write_at(struct inode *inode, const void *buffer_, off_t size, off_t
         return 0;
     }        
 
-    block_sector_t doubly_indirect;
-    struct inode_disk *data;
-    cache_sector_id src;
-    
+    /* Small files are written in their inode sector till they outgrow it.
+       Inline writers take the extension lock so none of them can slip in 
+       while the data is being moved out. */
+    if (inode->is_inline) {
+        lock_acquire(&inode->extension_lock);
+        if (inode->is_inline && offset + size <= INODE_INLINE_BYTES) {
+            bytes_written = inode_write_inline(inode, buffer, size, offset);
+            lock_release(&inode->extension_lock);
+            cache_throttle_writer();
+            return bytes_written;
+        }
+        if (inode->is_inline && !inode_move_inline(inode)) {
+            lock_release(&inode->extension_lock);
+            return 0;
+        }
+        lock_release(&inode->extension_lock);
+    }
+
     volatile off_t length = inode_length(inode);    
     bool am_extending = false;  /* A flag to let us release the file_extension
                                     lock after we do the extension + write
@@ -884,6 +980,7 @@ off_t inode_write_at(struct inode *inode, const void *buffer_, off_t size, off_t
     ASSERT(length >= 0);    
 
     off_t extension_limit = offset + size;            
+    off_t new_length = length;
     if (extension_limit > length) {
         
         lock_acquire(&inode->extension_lock);        
@@ -894,36 +991,16 @@ off_t inode_write_at(struct inode *inode, const void *buffer_, off_t size, off_t
 
             am_extending = true;
 
-            src = crab_into_cached_sector(inode->sector, true, false);            
-            data = (struct inode_disk *) get_cache_sector_base_addr(src);                        
-            doubly_indirect = data->doubly_indirect;                        
-            crab_outof_cached_sector(src, true);            
-
-
-            if (length == 0) {                                
-
-                ASSERT(doubly_indirect == SILLY_OLD_DISK_SECTOR);
-                inode_extend(true, 
-                            &doubly_indirect, 
-                            length,
-                            &extension_limit,
-                            true);
-
-                src = crab_into_cached_sector(inode->sector, false, false);            
-                data = (struct inode_disk *) get_cache_sector_base_addr(src);                        
-                data->doubly_indirect = doubly_indirect;                            
-                crab_outof_cached_sector(src, false);            
-
-            } else {
+            /*  Only what we're about to write gets data sectors. Anything
+                between the old end and OFFSET is left a hole, which reads
+                as zeros, till someone writes there. */
+            inode_extend(inode->sector, length, offset, &extension_limit, 
+                         true, direct);
+            inode_pin_index(inode);
 
-                ASSERT(doubly_indirect != SILLY_OLD_DISK_SECTOR);
-                inode_extend(false, 
-                            &doubly_indirect, 
-                            length,
-                            &extension_limit,
-                            true);                
-            }
-                        
+            /* We write no further than the extension got. */
+            if (extension_limit > length)
+                new_length = extension_limit;
             length = extension_limit;
         } 
 
@@ -933,8 +1010,7 @@ off_t inode_write_at(struct inode *inode, const void *buffer_, off_t size, off_t
     }    
 
     while (size > 0) {
-        /* Sector to write, starting byte offset within sector. */
-        block_sector_t sector_idx = byte_to_sector(inode, offset, am_extending);
+        /* Starting byte offset within sector. */
         int sector_ofs = offset % BLOCK_SECTOR_SIZE;
 
         /* Bytes left in inode, bytes left in sector, lesser of the two. */
@@ -946,11 +1022,38 @@ off_t inode_write_at(struct inode *inode, const void *buffer_, off_t size, off_t
         int chunk_size = size < min_left ? size : min_left;
         if (chunk_size <= 0)
             break;
+
+        /* Sector to write, only there if the extension got this far. */
+        block_sector_t sector_idx = byte_to_sector(inode, offset, am_extending);
+        if (sector_idx == SILLY_OLD_DISK_SECTOR) {
+            /*  A hole nobody's written yet. Give it, and any others we're 
+                about to write, data sectors first. Extenders already gave
+                theirs some. */
+            ASSERT(!am_extending);
+            off_t hole_limit = offset + size < length ? offset + size : length;
+            lock_acquire(&inode->extension_lock);
+            inode_extend(inode->sector, inode_length(inode), offset, 
+                         &hole_limit, true, false);
+            lock_release(&inode->extension_lock);
+            if (hole_limit <= offset)
+                break;
+            sector_idx = byte_to_sector(inode, offset, false);
+        }
                 
-        cache_sector_id dst = crab_into_cached_sector(sector_idx, false, false);          
-        cache_write(dst, (void *) (buffer + bytes_written), 
-            sector_ofs, chunk_size);
-        crab_outof_cached_sector(dst, false);
+        if (direct && chunk_size == BLOCK_SECTOR_SIZE) {
+            /* Whole sectors, as many as are together on disk. */
+            size_t n = direct_run_length(inode, sector_idx, offset, size, 
+                                         length, am_extending);
+            cache_direct_io(sector_idx, n, (void *) (buffer + bytes_written),
+                            false);
+            chunk_size = n * BLOCK_SECTOR_SIZE;
+        } else {
+            cache_sector_id dst = crab_into_cached_sector(sector_idx, false, 
+                                                          false);          
+            cache_write(dst, (void *) (buffer + bytes_written), 
+                sector_ofs, chunk_size);
+            crab_outof_cached_sector(dst, false);
+        }
 
         /* Advance. */
         size -= chunk_size;
@@ -959,13 +1062,112 @@ off_t inode_write_at(struct inode *inode, const void *buffer_, off_t size, off_t
     }
 
     if (am_extending) {
-        inode_set_length(inode, extension_limit);   
+        if (new_length > inode_length(inode))
+            inode_set_length(inode, new_length);   
         lock_release(&inode->extension_lock);
     }
 
+    /* Hold up writers dirtying the cache faster than it can be written. */
+    cache_throttle_writer();
+
     return bytes_written;
 }
 
+/*! Reads SIZE bytes at OFFSET of inline INODE into BUFFER. Returns the
+    number of bytes read, or -1 if INODE's data has been moved out of its
+    inode sector since the caller looked. */
+static off_t inode_read_inline(struct inode *inode, void *buffer, 
+                               off_t size, off_t offset) {
+    off_t bytes = -1;
+    cache_sector_id src = crab_into_cached_sector_of_class(inode->sector, 
+        true, false, CACHE_CLASS_INODE);
+    struct inode_disk *data = 
+        (struct inode_disk *) get_cache_sector_base_addr(src);
+
+    if (data->is_inline) {
+        bytes = data->length - offset;
+        if (bytes > size)
+            bytes = size;
+        if (bytes > 0)
+            cache_read(src, buffer, 
+                       offsetof(struct inode_disk, inline_data) + offset, 
+                       bytes);
+        else 
+            bytes = 0;
+    }
+    crab_outof_cached_sector(src, true);
+    return bytes;
+}
+
+/*! Writes SIZE bytes from BUFFER at OFFSET of inline INODE, growing it if
+    need be. OFFSET + SIZE must be within INODE_INLINE_BYTES. Must be called
+    with the extension lock held. Returns SIZE. */
+static off_t inode_write_inline(struct inode *inode, const void *buffer,
+                                off_t size, off_t offset) {
+    ASSERT(offset + size <= INODE_INLINE_BYTES);
+
+    cache_sector_id dst = crab_into_cached_sector_of_class(inode->sector, 
+        false, false, CACHE_CLASS_INODE);
+    struct inode_disk *data = 
+        (struct inode_disk *) get_cache_sector_base_addr(dst);
+
+    cache_write(dst, (void *) buffer, 
+                offsetof(struct inode_disk, inline_data) + offset, size);
+    if (offset + size > data->length) {
+        data->length = offset + size;
+        inode->length = data->length;
+    }
+    crab_outof_cached_sector(dst, false);
+    return size;
+}
+
+/*! Moves the data of inline INODE out to an indexed data sector, so it can
+    grow past INODE_INLINE_BYTES the usual way. Must be called with the 
+    extension lock held. Returns false, and leaves INODE inline, if the 
+    sectors can't be had. */
+static bool inode_move_inline(struct inode *inode) {
+    off_t length = inode->length;
+    block_sector_t sector;
+    struct inode_disk *data;
+    cache_sector_id src;
+    uint8_t *buffer;
+
+    if (length > 0) {
+        buffer = malloc((size_t) BLOCK_SECTOR_SIZE);
+        if (buffer == NULL) {
+            PANIC("Couldn't malloc enough room for inline data.");
+            NOT_REACHED();
+        }
+        src = crab_into_cached_sector_of_class(inode->sector, true, false,
+                                               CACHE_CLASS_INODE);
+        cache_read(src, buffer, offsetof(struct inode_disk, inline_data), 
+                   length);
+        crab_outof_cached_sector(src, true);
+
+        /* Inline data fits the first direct block, fill it in. */
+        if (!inode_extend(inode->sector, 0, 0, &length, false, false)) {
+            free(buffer);
+            return false;
+        }
+        sector = index_lookup(inode->sector, 0);
+
+        src = crab_into_cached_sector(sector, false, false);
+        cache_write(src, buffer, 0, length);
+        crab_outof_cached_sector(src, false);
+        free(buffer);
+    }
+
+    /* Readers check is_inline with the inode sector held, so they see the
+       data either still inline, or already in its sector. */
+    src = crab_into_cached_sector_of_class(inode->sector, false, false,
+                                           CACHE_CLASS_INODE);
+    data = (struct inode_disk *) get_cache_sector_base_addr(src);
+    data->is_inline = false;
+    inode->is_inline = false;
+    crab_outof_cached_sector(src, false);
+    return true;
+}
+
 /*! Disables writes to INODE.
     May be called at most once per inode opener. */
 void inode_deny_write (struct inode *inode) {
@@ -989,103 +1191,98 @@ void inode_allow_write (struct inode *inode) {
 /*! Returns the length, in bytes, of INODE's data */
 off_t inode_length(const struct inode *inode) {
     ASSERT (inode != NULL);
+    return inode->length;
+}
 
-    cache_sector_id src = crab_into_cached_sector(inode->sector, true, false);    
-    
-    struct inode_disk *data = 
-        (struct inode_disk *) get_cache_sector_base_addr(src);            
-    
-    off_t l = data->length;        
+/*! Returns the disk sector holding byte POS of INODE, looked up through its
+    index, or SILLY_OLD_DISK_SECTOR if POS is past the end of the file. */
+block_sector_t inode_sector_at(struct inode *inode, off_t pos) {
+    return byte_to_sector(inode, pos, false);
+}
 
-    crab_outof_cached_sector(src, true);        
+/*! Crabs into the cache sector holding byte OFFSET of INODE for reading, 
+    so the caller can look at the bytes there in place, without copying 
+    them out or reading ahead. On success, sets *DATA to OFFSET's byte, cuts
+    *SIZE down to how many bytes from there lie within both INODE and the 
+    sector, and returns the cache sector, which the caller must crab out of.
+    Returns NO_CACHE_SECTOR if OFFSET is past the end of INODE or in a 
+    hole. */
+cache_sector_id inode_crab_into_bytes(struct inode *inode, off_t offset,
+                                      off_t *size, const uint8_t **data) {
+    off_t sector_left = BLOCK_SECTOR_SIZE - offset % BLOCK_SECTOR_SIZE;
+    block_sector_t sector;
+    cache_sector_id src;
+    off_t bytes;
+
+    if (*size > sector_left)
+        *size = sector_left;
+
+    /* Readers check is_inline with the inode sector held, see
+       inode_move_inline. */
+    if (inode->is_inline) {
+        src = crab_into_cached_sector_of_class(inode->sector, true, false,
+                                               CACHE_CLASS_INODE);
+        struct inode_disk *disk = 
+            (struct inode_disk *) get_cache_sector_base_addr(src);
+        if (disk->is_inline) {
+            bytes = disk->length - offset;
+            if (bytes <= 0) {
+                crab_outof_cached_sector(src, true);
+                return NO_CACHE_SECTOR;
+            }
+            if (*size > bytes)
+                *size = bytes;
+            *data = disk->inline_data + offset;
+            return src;
+        }
+        crab_outof_cached_sector(src, true);
+    }
+
+    bytes = inode_length(inode) - offset;
+    if (bytes <= 0)
+        return NO_CACHE_SECTOR;
+    if (*size > bytes)
+        *size = bytes;
+    sector = byte_to_sector(inode, offset, false);
+    if (sector == SILLY_OLD_DISK_SECTOR)
+        return NO_CACHE_SECTOR;
+
+    src = crab_into_cached_sector(sector, true, false);
+    *data = (const uint8_t *) get_cache_sector_base_addr(src) + 
+            offset % BLOCK_SECTOR_SIZE;
+    return src;
+}
+
+/*! Returns how many entries directory INODE has in use. */
+uint32_t inode_entry_count(struct inode *inode) {
+    ASSERT(inode->is_dir);
+    cache_sector_id src = crab_into_cached_sector_of_class(inode->sector, 
+        true, false, CACHE_CLASS_INODE);
+    uint32_t cnt = 
+        ((struct inode_disk *) get_cache_sector_base_addr(src))->entry_cnt;
+    crab_outof_cached_sector(src, true);
+    return cnt;
+}
 
-    return l;
+/*! Adds DELTA to the count of entries directory INODE has in use. */
+void inode_add_entries(struct inode *inode, int delta) {
+    ASSERT(inode->is_dir);
+    cache_sector_id dst = crab_into_cached_sector_of_class(inode->sector, 
+        false, false, CACHE_CLASS_INODE);
+    ((struct inode_disk *) get_cache_sector_base_addr(dst))->entry_cnt += 
+        delta;
+    crab_outof_cached_sector(dst, false);
 }
 
-static void inode_set_length(const struct inode *inode, off_t updated_length) {
+static void inode_set_length(struct inode *inode, off_t updated_length) {
     ASSERT (inode != NULL);
-    cache_sector_id src = crab_into_cached_sector(inode->sector, false, false);    
+    cache_sector_id src = crab_into_cached_sector_of_class(inode->sector, 
+        false, false, CACHE_CLASS_INODE);
     struct inode_disk *data = 
         (struct inode_disk *) get_cache_sector_base_addr(src);            
     data->length = updated_length;
     crab_outof_cached_sector(src, false);            
-}
-
-/*! Returns the index of the first open entry in the list of directory
-    entries for the given directory DIR. Returns -1 if not found.
- */
-int inode_get_first_open_directory_slot(struct inode *dir) {
-	ASSERT(dir != NULL);
-	ASSERT(dir->is_dir);
-
-	int i;
-	for(i = 0; i < MAX_DIR_ENTRIES; i++) {
-		if (dir->dir_contents[i] == BOGUS_SECTOR)
-			return i;
-	}
-	return -1;
-}
-
-/*! Gets the directory entry in the given inode DIRECTORY with the
-    given NAME. Also gets the index at which it occurs. */
-void inode_find_matching_idx_and_sector(struct inode *directory,
-		const char *name, block_sector_t *the_sector, int *the_index) {
-	ASSERT(directory->is_dir);
-
-	// If the name is just "." or ".." return the appropriate sector numbers.
-	if (strcmp(name, "..") == 0 || strcmp(name, ".") == 0) {
-		if (thread_current()->cwd_sect == BOGUS_SECTOR) {
-			PANIC("Null cwd inode.");
-			NOT_REACHED();
-		}
-		block_sector_t rtn;
-		if (strcmp(name, "..") == 0) {
-			//rtn = thread_current()->cwd.inode->parent_dir;
-			rtn = directory->parent_dir;
-		}
-		else {
-			//rtn = thread_current()->cwd.inode->sector;
-			rtn = directory->sector;
-		}
-
-		*the_sector = rtn;
-		*the_index = -1;
-		return;
-	}
-
-	int i;
-	// Iterate over this directory's directory entries.
-	for (i = 0; i < MAX_DIR_ENTRIES; i++) {
-
-		block_sector_t curr_sect_num = directory->dir_contents[i];
-		if (curr_sect_num == BOGUS_SECTOR) {
-			continue;
-		}
-		struct inode *curr_inode = inode_open(curr_sect_num);
-		if (curr_inode == NULL) {
-			PANIC("Memory alloc problem in inode_open");
-			NOT_REACHED();
-		}
-		// Return this sector number if the filename matches.
-		if(strcmp(curr_inode->filename, name) == 0) {            		
-			*the_sector = curr_inode->sector;
-			*the_index = i;
-            inode_close(curr_inode);
-			return;
-		}
-		inode_close(curr_inode);
-	}
-
-	*the_sector = BOGUS_SECTOR;
-	*the_index = -1;
-	return;
-}
 
-/*! Gets the directory entry in the given inode with the given NAME. */
-block_sector_t inode_find_matching_dir_entry(
-		struct inode *directory, const char *name) {
-	int idx;
-	block_sector_t sect;
-	inode_find_matching_idx_and_sector(directory, name, &sect, &idx);
-	return sect;
+    /* Readers only look at the copy. */
+    inode->length = updated_length;
 }
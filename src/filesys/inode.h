@@ -4,8 +4,10 @@
 #include <stdbool.h>
 #include "filesys/off_t.h"
 #include "devices/block.h"
+#include "filesys/cache.h"
 #include "filesys/directory.h"
 #include "list.h"
+#include "hash.h"
 #include "bitmap.h"
 #include "threads/synch.h"
 #include "lib/kernel/list.h"
@@ -14,9 +16,17 @@ struct bitmap;
 
 #define INDIRECTION_REFERENCES ( BLOCK_SECTOR_SIZE/sizeof(block_sector_t) )
 
-/*! Temporary restriction on # of files possible in one directory entry
-    so we can work on extensible files in parallel w/ subdirectories. TODO*/
-#define MAX_DIR_ENTRIES 100
+/*! Number of data sectors the on-disk inode points to directly. The next
+    INDIRECTION_REFERENCES go through the single indirect block, and the
+    rest through the doubly indirect one. See filesys/index_sizing.py. */
+#define INODE_DIRECT_BLOCKS 12
+
+/*! Number of byte_to_sector results each open inode remembers. Must be a
+    power of two. */
+#define INODE_MAP_SLOTS 32
+
+/*! Most bytes of data a file may keep in its inode sector. */
+#define INODE_INLINE_BYTES 420
 
 /*! On-disk inode.
     Must be exactly BLOCK_SECTOR_SIZE bytes long. */
@@ -24,16 +34,27 @@ struct inode_disk {
     // block_sector_t start;            /*!< First data sector. */
     off_t length;                       /*!< File size in bytes. */
     bool is_dir;						/*!< True if is a directory. */
+    bool is_inline;                     /*!< True if data is in inline_data. */
     char filename[NAME_MAX + 1];
 
     /*! Sector of parent directory. Only set to not BOGUS_SECTOR for dirs. */
     block_sector_t parent_dir;
 
-    /*! Entries in this directory. Set to BOGUS_SECTOR if they are unused. */
-    block_sector_t dir_contents[MAX_DIR_ENTRIES];
+    /*! Entries in use, for directories, so telling whether one is empty
+        needn't read its buckets. */
+    uint32_t entry_cnt;
 
-    uint32_t unused[20];                /*!< Not used. */
+    /*! The data of a small file or directory, until it grows past 
+        INODE_INLINE_BYTES and moves out to data sectors. Zero past
+        length. */
+    uint8_t inline_data[INODE_INLINE_BYTES];
+
+    /*! The index, SILLY_OLD_DISK_SECTOR where nothing is allocated yet, 
+        as while the file is inline. @{ */
+    block_sector_t direct[INODE_DIRECT_BLOCKS];  /*!< First data sectors. */
+    block_sector_t single_indirect;     /*!< 64 Kb reference. */
     block_sector_t doubly_indirect;     /*!< 8 Mb reference. */
+    /*! @} */
     unsigned magic;                     /*!< Magic number. */
 };
 
@@ -42,23 +63,60 @@ struct indirection_block {
     block_sector_t sector[128];        
 };
 
+/*! A remembered byte_to_sector result: logical block BLOCK of the file is
+    in disk sector SECTOR. BLOCK is INODE_MAP_EMPTY in unused entries. */
+struct inode_map_entry {
+    uint32_t block;
+    block_sector_t sector;
+};
+#define INODE_MAP_EMPTY 0xFFFFFFFF
+
 /*! In-memory inode. */
 struct inode {
-    struct list_elem elem;              /*!< Element in inode list. */
+    struct hash_elem elem;              /*!< Element in open inode table. */
     block_sector_t sector;              /*!< Sector number of disk location. */
     int open_cnt;                       /*!< Number of openers. */
-    bool removed;                       /*!< T if deleted, F otherwise. */
     int deny_write_cnt;                 /*!< 0: writes ok, >0: deny writes. */
+    bool removed;                       /*!< T if deleted, F otherwise. */
     bool is_dir;						/*!< True if is a directory. */
-    char filename[NAME_MAX + 1];		/*!< Filename for this inode. */
-    struct lock ismd_lock;              /*!< Inode Struct Metadata Lock */
+    /*! True while the data is in the on-disk inode. Only cleared, under 
+        extension_lock, once the data sectors hold it all. */
+    bool is_inline;
+    bool sector_pinned;                 /*!< Is our on-disk inode pinned? */
+    /*! True from going in the open inode table till what we keep of the
+        on-disk inode has been read. Protected by the table's stripe lock. */
+    bool loading;
+    /*! Inode Struct Metadata Lock. Guards open_cnt, deny_write_cnt and
+        map, all only held for a few instructions. */
+    struct lock ismd_lock;
     struct lock extension_lock;         /*!< Extension lock */
+
+    /*! Copy of the on-disk length, kept up to date by inode_set_length. */
+    off_t length;
+
+    /*! Recent byte_to_sector results, direct mapped by logical block, so
+        steady-state lookups don't crab through the index at all. Blocks 
+        never move once allocated, so entries only go stale if the file is
+        removed, or if an extension is rolled back. Protected by ismd_lock.
+        INODE_MAP_SLOTS entries, allocated on the first lookup through the
+        index, so inline files and directories never carry it. */
+    struct inode_map_entry *map;
+
+    /*! Indirection sectors pinned in the cache while we're open, along with
+        our on-disk inode if sector_pinned, see inode_pin_index. @{ */
+    block_sector_t pinned_single;       /*!< Pinned single indirect block. */
+    block_sector_t pinned_doubly;       /*!< Pinned doubly indirect block. */
+    /*! @} */
+
+    /*! Sequential read detection, see filesys_read_ahead. Protected by
+        monitor_ra. @{ */
+    off_t ra_next;                      /*!< Where a sequential read starts. */
+    off_t ra_queued;                    /*!< End of what's been read ahead. */
+    unsigned ra_window;                 /*!< Sectors to keep read ahead. */
+    /*! @} */
     
     /*! Sector of parent directory. Only set to not BOGUS_SECTOR for dirs. */
     block_sector_t parent_dir;
-
-    /*! Entries in this directory. Nulled if is not a directory. */
-    block_sector_t dir_contents[MAX_DIR_ENTRIES];
 };
 
 void inode_init(void);
@@ -71,15 +129,17 @@ void inode_close(struct inode *);
 void inode_remove(struct inode *);
 off_t inode_read_at(struct inode *, void *, off_t size, off_t offset);
 off_t inode_write_at(struct inode *, const void *, off_t size, off_t offset);
+off_t inode_read_at_direct(struct inode *, void *, off_t size, off_t offset);
+off_t inode_write_at_direct(struct inode *, const void *, off_t size, 
+                            off_t offset);
 void inode_deny_write(struct inode *);
 void inode_allow_write(struct inode *);
 off_t inode_length(const struct inode *);
+block_sector_t inode_sector_at(struct inode *, off_t pos);
+cache_sector_id inode_crab_into_bytes(struct inode *, off_t offset,
+                                      off_t *size, const uint8_t **data);
+uint32_t inode_entry_count(struct inode *);
+void inode_add_entries(struct inode *, int delta);
 void inode_tree_destroy(block_sector_t inode_sector);
 
-block_sector_t inode_find_matching_dir_entry(
-		struct inode *tmp_inode, const char *curr_dir_name);
-int inode_get_first_open_directory_slot(struct inode *the_inode);
-void inode_find_matching_idx_and_sector(struct inode *directory,
-		const char *name, block_sector_t *the_sector, int *the_index);
-
 #endif /* filesys/inode.h */
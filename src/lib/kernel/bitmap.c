@@ -3,6 +3,7 @@
 #include <limits.h>
 #include <round.h>
 #include <stdio.h>
+#include <string.h>
 #include "threads/malloc.h"
 #ifdef FILESYS
 #include "filesys/file.h"
@@ -193,6 +194,27 @@ bitmap_flip (struct bitmap *b, size_t bit_idx)
   asm ("xorl %1, %0" : "=m" (b->bits[idx]) : "r" (mask) : "cc");
 }
 
+/* Atomically sets the bit numbered BIT_IDX in B to false,
+   returning its previous value. */
+bool
+bitmap_test_and_reset (struct bitmap *b, size_t bit_idx) 
+{
+  size_t idx = elem_idx (bit_idx);
+  elem_type bit = bit_idx % ELEM_BITS;
+  unsigned char old;
+
+  ASSERT (b != NULL);
+  ASSERT (bit_idx < b->bit_cnt);
+
+  /* This is equivalent to `old = b->bits[idx] & mask;
+     b->bits[idx] &= ~mask' except that it is guaranteed to be
+     atomic on a uniprocessor machine.  See the description of
+     the BTR instruction in [IA32-v2a]. */
+  asm volatile ("btrl %2, %0; setc %1"
+                : "+m" (b->bits[idx]), "=q" (old) : "r" (bit) : "cc");
+  return old != 0;
+}
+
 /* Returns the value of the bit numbered IDX in B. */
 bool
 bitmap_test (const struct bitmap *b, size_t idx) 
@@ -358,6 +380,23 @@ bitmap_write (const struct bitmap *b, struct file *file)
   off_t size = byte_cnt (b->bit_cnt);
   return file_write_at (file, b->bits, size, 0) == size;
 }
+
+/* Copies the CNT bytes of B starting at byte START, as
+   bitmap_write would lay them out in a file, to DST.  Bytes past
+   the end of B are left out.  Returns the number of bytes
+   copied. */
+size_t
+bitmap_copy_bytes (const struct bitmap *b, size_t start, size_t cnt,
+                   void *dst)
+{
+  size_t size = byte_cnt (b->bit_cnt);
+  if (start >= size)
+    return 0;
+  if (cnt > size - start)
+    cnt = size - start;
+  memcpy (dst, (const uint8_t *) b->bits + start, cnt);
+  return cnt;
+}
 #endif /* FILESYS */
 
 /* Debugging. */
@@ -22,6 +22,7 @@ void bitmap_mark (struct bitmap *, size_t idx);
 void bitmap_reset (struct bitmap *, size_t idx);
 void bitmap_flip (struct bitmap *, size_t idx);
 bool bitmap_test (const struct bitmap *, size_t idx);
+bool bitmap_test_and_reset (struct bitmap *, size_t idx);
 
 /* Setting and testing multiple bits. */
 void bitmap_set_all (struct bitmap *, bool);
@@ -43,6 +44,8 @@ struct file;
 size_t bitmap_file_size (const struct bitmap *);
 bool bitmap_read (struct bitmap *, struct file *);
 bool bitmap_write (const struct bitmap *, struct file *);
+size_t bitmap_copy_bytes (const struct bitmap *, size_t start, size_t cnt,
+                          void *dst);
 #endif
 
 /* Debugging. */
@@ -153,3 +153,11 @@ int inumber(int fd) {
     return syscall1(SYS_INUMBER, fd);
 }
 
+bool cachestats(struct cache_stats *stats) {
+    return syscall1(SYS_CACHESTATS, stats);
+}
+
+bool directio(int fd, bool direct) {
+    return syscall2(SYS_DIRECTIO, fd, (int) direct);
+}
+
@@ -15,6 +15,26 @@ typedef int mapid_t;
 /*! Maximum characters in a filename written by readdir(). */
 #define READDIR_MAX_LEN 14
 
+/*! Buffer cache statistics, as sampled by cachestats(). All counts are
+    since boot, and wait times are in timer ticks. */
+struct cache_stats {
+    unsigned long long hits;             /*!< Lookups found in the cache. */
+    unsigned long long misses;           /*!< Lookups that had to load. */
+    unsigned long long clean_evictions;  /*!< Evicted without a write. */
+    unsigned long long dirty_evictions;  /*!< Written back to be evicted. */
+    unsigned long long prefetch_issued;  /*!< Sectors read ahead. */
+    unsigned long long prefetch_used;    /*!< ...then asked for. */
+    unsigned long long prefetch_wasted;  /*!< ...evicted unasked for. */
+    unsigned long long write_behind_sectors; /*!< Written by flushes. */
+    unsigned long long writers_throttled;    /*!< Writers held up. */
+    unsigned long long pending_io_waits;     /*!< Waits for pending io. */
+    unsigned long long pending_io_wait_ticks;
+    unsigned long long io_lock_waits;    /*!< Waits for sector r/w/io locks. */
+    unsigned long long io_lock_wait_ticks;
+    unsigned long long direct_sectors;   /*!< Moved bypassing the cache. */
+    unsigned long long direct_cached_sectors; /*!< ...or cached, so not. */
+};
+
 /*! Typical return values from main() and arguments to exit(). */
 #define EXIT_SUCCESS 0          /*!< Successful execution. */
 #define EXIT_FAILURE 1          /*!< Unsuccessful execution. */
@@ -45,5 +65,9 @@ bool readdir(int fd, char name[READDIR_MAX_LEN + 1]);
 bool isdir(int fd);
 int inumber(int fd);
 
+/* Extensions. */
+bool cachestats(struct cache_stats *);
+bool directio(int fd, bool direct);
+
 #endif /* lib/user/syscall.h */
 
@@ -0,0 +1,9 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+use tests::random;
+my ($small) = random_bytes (4096);
+my ($big) = random_bytes (524288);
+check_archive ({"small" => [$small], "big" => [$big]});
+pass;
@@ -0,0 +1,87 @@
+/* Reads a file twice in a row and checks with cachestats() that
+   the second read, of a file that fits in the buffer cache, hits
+   more often than the first, after a larger file has pushed it
+   out. The counters are shared with read-ahead and write-behind,
+   so we only allow the second read a few misses, not none. */
+
+#include <random.h>
+#include <syscall.h>
+#include "tests/lib.h"
+#include "tests/main.h"
+
+#define SMALL_SIZE 4096         /* 8 sectors. */
+#define BIG_SIZE 524288         /* Far past any sensible cache size. */
+#define CHUNK_SIZE 32768        /* Written BIG_SIZE / CHUNK_SIZE times. */
+#define MAX_MISSES 2            /* Allowed the second read. */
+
+static char small[SMALL_SIZE];
+static char chunk[CHUNK_SIZE];
+static char buf[SMALL_SIZE];
+
+/* Reads all of "small" through FD, checking what comes back, and
+   sets *HITS and *MISSES to how much the cache counters moved. */
+static void
+read_small (int fd, unsigned long long *hits, unsigned long long *misses) 
+{
+  struct cache_stats before, after;
+
+  seek (fd, 0);
+  if (!cachestats (&before))
+    fail ("cachestats failed");
+  if (read (fd, buf, sizeof buf) != (int) sizeof buf)
+    fail ("read of \"small\" came up short");
+  if (!cachestats (&after))
+    fail ("cachestats failed");
+  compare_bytes (buf, small, sizeof buf, 0, "small");
+
+  *hits = after.hits - before.hits;
+  *misses = after.misses - before.misses;
+}
+
+void
+test_main (void) 
+{
+  unsigned long long hits1, misses1, hits2, misses2;
+  size_t ofs;
+  int fd;
+
+  random_bytes (small, sizeof small);
+
+  CHECK (create ("small", 0), "create \"small\"");
+  CHECK ((fd = open ("small")) > 1, "open \"small\"");
+  CHECK (write (fd, small, sizeof small) == sizeof small, "write \"small\"");
+  msg ("close \"small\"");
+  close (fd);
+
+  CHECK (create ("big", 0), "create \"big\"");
+  CHECK ((fd = open ("big")) > 1, "open \"big\"");
+  msg ("write \"big\"");
+  for (ofs = 0; ofs < BIG_SIZE; ofs += CHUNK_SIZE)
+    {
+      random_bytes (chunk, sizeof chunk);
+      if (write (fd, chunk, sizeof chunk) != sizeof chunk)
+        fail ("write %zu bytes at offset %zu in \"big\" failed",
+              sizeof chunk, ofs);
+    }
+  msg ("close \"big\"");
+  close (fd);
+
+  CHECK ((fd = open ("small")) > 1, "open \"small\"");
+  msg ("read \"small\" once");
+  read_small (fd, &hits1, &misses1);
+  msg ("read \"small\" again");
+  read_small (fd, &hits2, &misses2);
+  msg ("close \"small\"");
+  close (fd);
+
+  /* Hit rate rises: hits2 / (hits2 + misses2) > hits1 / (hits1 + misses1). */
+  if (hits2 * (hits1 + misses1) <= hits1 * (hits2 + misses2))
+    fail ("hit rate didn't rise: %llu hits, %llu misses, then "
+          "%llu hits, %llu misses", hits1, misses1, hits2, misses2);
+  if (misses2 > MAX_MISSES)
+    fail ("second read of \"small\" missed %llu sectors", misses2);
+  if (hits2 < SMALL_SIZE / 512)
+    fail ("second read of \"small\" hit %llu sectors, expected %d or more",
+          hits2, SMALL_SIZE / 512);
+  msg ("cache counters moved as expected");
+}
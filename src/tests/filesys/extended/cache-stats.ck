@@ -0,0 +1,22 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+check_expected (IGNORE_EXIT_CODES => 1, [<<'EOF']);
+(cache-stats) begin
+(cache-stats) create "small"
+(cache-stats) open "small"
+(cache-stats) write "small"
+(cache-stats) close "small"
+(cache-stats) create "big"
+(cache-stats) open "big"
+(cache-stats) write "big"
+(cache-stats) close "big"
+(cache-stats) open "small"
+(cache-stats) read "small" once
+(cache-stats) read "small" again
+(cache-stats) close "small"
+(cache-stats) cache counters moved as expected
+(cache-stats) end
+EOF
+pass;
@@ -0,0 +1,104 @@
+/* Writes one file through two descriptors, one set to bypass the
+   buffer cache with directio() and one not, in turns and at
+   offsets that leave part-sector heads and tails, and checks
+   after each write that the other descriptor reads it back.
+   Checks with cachestats() that whole sectors moved through the
+   directio() descriptor really do bypass the cache. */
+
+#include <random.h>
+#include <string.h>
+#include <syscall.h>
+#include "tests/lib.h"
+#include "tests/main.h"
+
+#define FILE_SIZE 20000
+#define SECTOR_SIZE 512
+#define READ_SIZE 4096          /* Sector-aligned, read directly. */
+
+static char expected[FILE_SIZE];
+static char data[FILE_SIZE];
+static char buf[FILE_SIZE];
+
+/* Writes DATA's bytes OFS through OFS + SIZE - 1 at the same
+   offset through FD, and keeps EXPECTED in step. */
+static void
+write_at (int fd, const char *how, size_t ofs, size_t size) 
+{
+  seek (fd, ofs);
+  CHECK (write (fd, data + ofs, size) == (int) size,
+         "%s write of bytes %zu through %zu", how, ofs, ofs + size - 1);
+  memcpy (expected + ofs, data + ofs, size);
+}
+
+/* Reads bytes OFS through OFS + SIZE - 1 through FD and checks
+   them against EXPECTED. */
+static void
+read_at (int fd, const char *how, size_t ofs, size_t size) 
+{
+  seek (fd, ofs);
+  CHECK (read (fd, buf, size) == (int) size,
+         "%s read of bytes %zu through %zu", how, ofs, ofs + size - 1);
+  compare_bytes (buf, expected + ofs, size, ofs, "dio");
+}
+
+/* Returns how many sectors have moved bypassing the cache. */
+static unsigned long long
+direct_sectors (void) 
+{
+  struct cache_stats stats;
+
+  if (!cachestats (&stats))
+    fail ("cachestats failed");
+  return stats.direct_sectors;
+}
+
+void
+test_main (void) 
+{
+  unsigned long long before;
+  int direct_fd, cached_fd;
+
+  random_bytes (data, sizeof data);
+  memset (expected, 'Z', sizeof expected);
+
+  CHECK (create ("dio", 0), "create \"dio\"");
+  CHECK ((direct_fd = open ("dio")) > 1, "open \"dio\"");
+  CHECK (directio (direct_fd, true), "directio \"dio\"");
+  CHECK ((cached_fd = open ("dio")) > 1, "open \"dio\" again");
+
+  /* Grow the file directly, and read the start of it back directly
+     before anything has been through the cache, checking both
+     bypassed it, then pull part of it into the cache. */
+  before = direct_sectors ();
+  seek (direct_fd, 0);
+  CHECK (write (direct_fd, expected, sizeof expected) == sizeof expected,
+         "direct write of \"dio\"");
+  CHECK (direct_sectors () - before >= FILE_SIZE / SECTOR_SIZE,
+         "direct write bypassed the cache for %d sectors",
+         FILE_SIZE / SECTOR_SIZE);
+  before = direct_sectors ();
+  read_at (direct_fd, "direct", 0, READ_SIZE);
+  CHECK (direct_sectors () - before >= READ_SIZE / SECTOR_SIZE,
+         "direct read bypassed the cache for %d sectors",
+         READ_SIZE / SECTOR_SIZE);
+  read_at (cached_fd, "cached", 5000, 3000);
+
+  /* Overwrite all of it in turns, the direct writes starting and
+     ending mid-sector, the first over the sectors just cached. */
+  write_at (cached_fd, "cached", 0, 700);
+  read_at (direct_fd, "direct", 0, 1024);
+  write_at (direct_fd, "direct", 700, 8400);
+  read_at (cached_fd, "cached", 0, 9100);
+  write_at (cached_fd, "cached", 9100, 800);
+  read_at (direct_fd, "direct", 8704, 1300);
+  write_at (direct_fd, "direct", 9900, 10100);
+  read_at (cached_fd, "cached", 9000, 11000);
+
+  seek (direct_fd, 0);
+  check_file_handle (direct_fd, "dio", expected, sizeof expected);
+  msg ("close \"dio\"");
+  close (direct_fd);
+  msg ("close \"dio\" again");
+  close (cached_fd);
+  check_file ("dio", expected, sizeof expected);
+}
@@ -0,0 +1,32 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+check_expected (IGNORE_EXIT_CODES => 1, [<<'EOF']);
+(direct-io) begin
+(direct-io) create "dio"
+(direct-io) open "dio"
+(direct-io) directio "dio"
+(direct-io) open "dio" again
+(direct-io) direct write of "dio"
+(direct-io) direct write bypassed the cache for 39 sectors
+(direct-io) direct read of bytes 0 through 4095
+(direct-io) direct read bypassed the cache for 8 sectors
+(direct-io) cached read of bytes 5000 through 7999
+(direct-io) cached write of bytes 0 through 699
+(direct-io) direct read of bytes 0 through 1023
+(direct-io) direct write of bytes 700 through 9099
+(direct-io) cached read of bytes 0 through 9099
+(direct-io) cached write of bytes 9100 through 9899
+(direct-io) direct read of bytes 8704 through 10003
+(direct-io) direct write of bytes 9900 through 19999
+(direct-io) cached read of bytes 9000 through 19999
+(direct-io) verified contents of "dio"
+(direct-io) close "dio"
+(direct-io) close "dio" again
+(direct-io) open "dio" for verification
+(direct-io) verified contents of "dio"
+(direct-io) close "dio"
+(direct-io) end
+EOF
+pass;
@@ -247,6 +247,16 @@ static char ** parse_options(char **argv) {
             filesys_bdev_name = value;
         else if (!strcmp(name, "-scratch"))
             scratch_bdev_name = value;
+        else if (!strcmp(name, "-fs-cache"))
+            file_cache_configure(value);
+        else if (!strcmp(name, "-fs-cache-policy"))
+            file_cache_configure_policy(value);
+        else if (!strcmp(name, "-fs-ra-window"))
+            filesys_configure_read_ahead(value);
+        else if (!strcmp(name, "-fs-dirty"))
+            file_cache_configure_dirty(value);
+        else if (!strcmp(name, "-fs-dirty-expire"))
+            file_cache_configure_dirty_expire(value);
 #ifdef VM
         else if (!strcmp(name, "-swap"))
             swap_bdev_name = value;
@@ -367,6 +377,11 @@ static void usage(void) {
            "  -f                 Format file system device during startup.\n"
            "  -filesys=BDEV      Use BDEV for file system instead of default.\n"
            "  -scratch=BDEV      Use BDEV for scratch instead of default.\n"
+           "  -fs-cache=N[%%]     Cache N sectors (min 56), or N%% of pool.\n"
+           "  -fs-cache-policy=P Replace cached sectors by P, clock or 2q.\n"
+           "  -fs-ra-window=N    Read at most N sectors ahead, 0 for none.\n"
+           "  -fs-dirty=HIGH,LOW Write back dirty cache from HIGH%% to LOW%%.\n"
+           "  -fs-dirty-expire=T Write back sectors dirty for T ticks.\n"
 #ifdef VM
            "  -swap=BDEV         Use BDEV for swap instead of default.\n"
 #endif
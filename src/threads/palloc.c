@@ -135,6 +135,18 @@ void palloc_free_page(void *page) {
     palloc_free_multiple(page, 1);
 }
 
+/*! Returns the number of pages currently free in the kernel pool. */
+size_t palloc_free_kernel_pages(void) {
+    size_t free_cnt;
+
+    lock_acquire(&kernel_pool.lock);
+    free_cnt = bitmap_count(kernel_pool.used_map, 0,
+                            bitmap_size(kernel_pool.used_map), false);
+    lock_release(&kernel_pool.lock);
+
+    return free_cnt;
+}
+
 /*! Initializes pool P as starting at START and ending at END,
     naming it NAME for debugging purposes. */
 static void init_pool(struct pool *p, void *base, size_t page_cnt,
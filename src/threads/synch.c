@@ -342,13 +342,16 @@ void rw_init(struct rwlock *rwlock) {
     coherent with disk again. By external calling convention, callers must
     ensure that only one thread is either waiting or actively holding the 
     disk io lock. For example, in filesys/cache.c, callers use a synchronous
-    flag to check whether someone else is about to request an io lock. */
-void rw_acquire(struct rwlock *rwlock, bool read, bool io) {
+    flag to check whether someone else is about to request an io lock. 
+    
+    Returns true if we had to wait. */
+bool rw_acquire(struct rwlock *rwlock, bool read, bool io) {
 	ASSERT(rwlock != NULL);
 
     /* If IO is true, read is arbitrary */    
     bool write = !read && !io;    
     read = read && !io;
+    bool waited = false;
 
 	lock_acquire(&rwlock->lock);
 	switch (rwlock->mode) {
@@ -380,6 +383,7 @@ void rw_acquire(struct rwlock *rwlock, bool read, bool io) {
 			}
 			else {
 				rwlock->num_waiting_readers++;
+				waited = true;
 				do {
 					cond_wait(&rwlock->rcond, &rwlock->lock);
 				} while(rwlock->mode != RLOCKED);
@@ -389,6 +393,7 @@ void rw_acquire(struct rwlock *rwlock, bool read, bool io) {
 		}
 		else if (write) {
 			rwlock->num_waiting_writers++;
+			waited = true;
 			do {
 				cond_wait(&rwlock->wcond, &rwlock->lock);
 			} while (rwlock->mode != WLOCKED);
@@ -397,6 +402,7 @@ void rw_acquire(struct rwlock *rwlock, bool read, bool io) {
 		} else {
             /* IO Request */                        
             rwlock->num_waiting_ioers++;
+            waited = true;
             ASSERT(rwlock->num_waiting_ioers == 1);
             do {
                 cond_wait(&rwlock->iocond, &rwlock->lock);
@@ -413,6 +419,7 @@ void rw_acquire(struct rwlock *rwlock, bool read, bool io) {
 		does. */
 		if (read) {
 			rwlock->num_waiting_readers++;
+			waited = true;
 			do {
 				cond_wait(&rwlock->rcond, &rwlock->lock);
 			} while(rwlock->mode != RLOCKED);
@@ -420,6 +427,7 @@ void rw_acquire(struct rwlock *rwlock, bool read, bool io) {
 			ASSERT(rwlock->mode == RLOCKED);
 		} else if (write) {
 			rwlock->num_waiting_writers++;
+			waited = true;
 			do {
 				cond_wait(&rwlock->wcond, &rwlock->lock);
 			} while (rwlock->mode != WLOCKED);
@@ -428,6 +436,7 @@ void rw_acquire(struct rwlock *rwlock, bool read, bool io) {
 		} else {
             /* IO Request */                        
             rwlock->num_waiting_ioers++;
+            waited = true;
             ASSERT(rwlock->num_waiting_ioers == 1);
             do {
                 cond_wait(&rwlock->iocond, &rwlock->lock);
@@ -439,6 +448,7 @@ void rw_acquire(struct rwlock *rwlock, bool read, bool io) {
 	case IOLOCKED:
         if (read) {
             rwlock->num_waiting_readers++;
+            waited = true;
             do {
                 cond_wait(&rwlock->rcond, &rwlock->lock);
             } while(rwlock->mode != RLOCKED);
@@ -446,6 +456,7 @@ void rw_acquire(struct rwlock *rwlock, bool read, bool io) {
             ASSERT(rwlock->mode == RLOCKED);
         } else if (write) {
             rwlock->num_waiting_writers++;
+            waited = true;
             do {
                 cond_wait(&rwlock->wcond, &rwlock->lock);
             } while (rwlock->mode != WLOCKED);
@@ -466,6 +477,26 @@ void rw_acquire(struct rwlock *rwlock, bool read, bool io) {
     }
 
 	lock_release(&rwlock->lock);
+
+    return waited;
+}
+
+/*! Acquires the given read/write lock as a disk IO lock, as rw_acquire, but
+    only if no one holds it or is waiting for it. Never waits. Returns true
+    if the lock was acquired. The same external calling convention applies. */
+bool rw_try_acquire_io(struct rwlock *rwlock) {
+	bool success = false;
+
+	ASSERT(rwlock != NULL);
+
+	lock_acquire(&rwlock->lock);
+	if (rwlock->mode == UNLOCKED) {
+		rwlock->mode = IOLOCKED;
+		success = true;
+	}
+	lock_release(&rwlock->lock);
+
+	return success;
 }
 
 /*! Releases the given read/write lock as a reader if READ is true or as a
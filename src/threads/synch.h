@@ -64,7 +64,8 @@ struct rwlock {
 };
 
 void rw_init(struct rwlock *);
-void rw_acquire(struct rwlock *, bool, bool);
+bool rw_acquire(struct rwlock *, bool, bool);
+bool rw_try_acquire_io(struct rwlock *);
 void rw_release(struct rwlock *, bool, bool);
 
 /*! Optimization barrier.
@@ -690,12 +690,12 @@ bool thread_is_dir_deletable(const char *path) {
 	}
 
 	/* Make sure it's empty. */
-	int i;
-	for (i = 0; i < MAX_DIR_ENTRIES; i++) {
-		if (dir_inode->dir_contents[i] != BOGUS_SECTOR) {
-			inode_close(dir_inode);
-			return true;
-		}
+	struct dir dir_static;
+	dir_static.inode = dir_inode;
+	dir_static.pos = 0;
+	if (!dir_is_empty(&dir_static)) {
+		inode_close(dir_inode);
+		return true;
 	}
 
 	inode_close(dir_inode);
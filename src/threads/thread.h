@@ -21,8 +21,9 @@ typedef int tid_t;						/*! Thread ID type. */
 #define PRI_DEFAULT 31                  /*!< Default priority. */
 #define PRI_MAX 63                      /*!< Highest priority. */
 
-/*! Number of ticks until the cache is flushed to disk. Chosen to be roughly
-    three times the length of a disk write. */
+/*! Number of ticks between write-behind's checks for cache sectors that
+    have been dirty too long. Chosen to be roughly three times the length of
+    a disk write. */
 #define TICKS_UNTIL_WRITEBACK 512
 
 // ---------------------------- Global variables ------------------------------
@@ -20,6 +20,7 @@
 #include "filesys/directory.h"
 #include "filesys/inode.h"
 #include "filesys/free-map.h"
+#include "filesys/cache.h"
 
 //----------------------------- Global variables ------------------------------
 
@@ -148,6 +149,10 @@ static void sc_handler(struct intr_frame *f) {
 		f->eax = isdir((pid_t) sc_n1);
 	else if (sc_n == SYS_INUMBER)
 		f->eax = inumber((pid_t) sc_n1);
+	else if (sc_n == SYS_CACHESTATS)
+		f->eax = cachestats((struct cache_stats *) sc_n1);
+	else if (sc_n == SYS_DIRECTIO)
+		f->eax = directio(sc_n1, (bool) sc_n2);
 	else
 		PANIC("Unsupported syscall number.");
 }
@@ -576,3 +581,26 @@ int inumber(int fd) {
 		return BOGUS_SECTOR;
 	return inode_get_inumber(f->file->inode);
 }
+
+/*! Fills in STATS with the buffer cache statistics so far. Returns false if
+    STATS isn't a valid user buffer. */
+bool cachestats(struct cache_stats *stats) {
+	if (!uptr_is_valid(stats) || 
+		!uptr_is_valid((char *) stats + sizeof *stats - 1))
+		return false;
+
+	cache_get_stats(stats);
+	return true;
+}
+
+/*! Sets whether reads and writes of whole sectors through fd bypass the
+    buffer cache. Returns false if fd isn't an open file, or is a 
+    directory. */
+bool directio(int fd, bool direct) {
+	struct fd_element *f = thread_get_matching_fd_elem(fd);
+	if (f == NULL || f->file->inode->is_dir)
+		return false;
+
+	file_set_direct(f->file, direct);
+	return true;
+}